@@ -0,0 +1,1066 @@
+#define _POSIX_C_SOURCE (200809L)
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "adc_ioctl.h"
+
+#define bool char
+#define true (1)
+#define false (0)
+
+#define DEVICE_PREFIX "/dev/adc"
+#define NANOSECOND (1000000000LL)
+#define TEXT_BUFFER (32)
+#define MAX_RESULTS (ADC_BATCH_MAX)
+#define STREAM_SAMPLES (64)
+#define MAX_THREADS (64)
+#define LATENCY_RESERVOIR (65536)     // latencies kept per thread, later ones replace random earlier ones
+#define SIM_BAND (341)                // the simulated channel n stays within [n * SIM_BAND, (n + 1) * SIM_BAND)
+#define SIM_PERIOD_NS (10000000LL)
+#define VALID_DEVICE_HANDLE(h) (!((h) < 0))
+#define CLOSE_INVALIDATE(h) (close(h), (h) = -1)
+
+enum Mode
+{
+	MODE_ASCII,      // open, read and close for every sample like stress.sh
+	MODE_REPEAT,
+	MODE_CACHED,
+	MODE_MILLIVOLT,
+	MODE_STREAM,
+	MODE_SCAN,
+	MODE_BATCH,
+	MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = { "ascii", "repeat", "cached", "millivolt", "stream", "scan", "batch" };
+static const int driver_modes[MODE_COUNT] = { ADC_MODE_ASCII, ADC_MODE_REPEAT, ADC_MODE_CACHED, ADC_MODE_MILLIVOLT, ADC_MODE_STREAM, ADC_MODE_SCAN, ADC_MODE_ASCII };
+
+enum Format
+{
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON
+};
+
+// Values a channel is expected to stay in, anything else is counted as out of band
+struct Band
+{
+	bool set;
+	int min;
+	int max;
+};
+
+struct Parameters
+{
+	const char* device;
+	bool simulate;
+	int mode;
+	int threads;
+	unsigned int channels;      // bit mask
+	double duration;
+	int batch_repeat;
+	long long conversion_ns;    // simulated conversion time
+	long long max_age_ns;       // age of a simulated cached value
+	double fault_rate;          // simulated results that come from the wrong channel, are stale or dropped
+	int format;
+	struct Band bands[ADC_NUMCHANNELS];
+};
+
+struct Result
+{
+	int channel;
+	int value;
+	long long timestamp;        // 0 if the mode has none
+	bool tagged;                // channel and sequence come from the driver
+	unsigned int sequence;
+};
+
+struct Latencies
+{
+	long long* values;
+	size_t count;
+	unsigned long long seen;
+	unsigned int seed;
+};
+
+struct Reader
+{
+	pthread_t thread;
+	int index;
+	int channel;                // for the single channel modes
+	int fd;
+	struct Parameters* params;
+
+	unsigned long long reads;
+	unsigned long long samples;
+	unsigned long long errors;
+	unsigned long long wrong_channel;
+	unsigned long long out_of_band;
+	unsigned long long stale;
+	int last_error;
+
+	// threads streaming the same channel drain the same driver ring, so gaps are only counted over all of them
+	long long last_timestamp[ADC_NUMCHANNELS];
+	bool sequence_valid[ADC_NUMCHANNELS];
+	unsigned int sequence_first[ADC_NUMCHANNELS];
+	unsigned int sequence_last[ADC_NUMCHANNELS];
+	unsigned long long sequence_count[ADC_NUMCHANNELS];
+	struct Latencies latencies;
+	struct Result results[MAX_RESULTS];
+	__u16 batch_values[ADC_BATCH_MAX];
+
+	// simulated backend
+	unsigned int sim_seed;
+};
+
+struct Backend
+{
+	const char* name;
+	int  (*open) (struct Reader* reader);
+	int  (*read) (struct Reader* reader, struct Result* results, long long start);  // number of results or -1 and errno
+	void (*close) (struct Reader* reader);
+};
+
+volatile sig_atomic_t stop;
+
+static const struct Backend* backend;
+
+void inthand(int signum)
+{
+	stop = 1;
+}
+
+static long long now_ns(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec * NANOSECOND + spec.tv_nsec;
+}
+
+static int first_channel(unsigned int mask)
+{
+	for (int i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		if ((mask & (1u << i)) != 0)
+		{
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+static int count_channels(unsigned int mask)
+{
+	int count = 0;
+
+	for (int i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		count += (mask & (1u << i)) != 0;
+	}
+
+	return count;
+}
+
+static bool parse_value(const char* text, int* value)
+{
+	char* end;
+
+	errno = 0;
+	*value = strtol(text, &end, 10);
+	return errno == 0 && end != text;
+}
+
+/* Device backend, talks to /dev/adcN */
+
+static int device_open_channel(struct Reader* reader, int channel)
+{
+	char path[TEXT_BUFFER];
+
+	snprintf(path, sizeof(path), "%s%d", reader->params->device, channel);
+	return open(path, O_RDONLY);
+}
+
+static int device_open(struct Reader* reader)
+{
+	int mode = driver_modes[reader->params->mode];
+
+	if (reader->params->mode == MODE_ASCII)
+	{
+		return 0;
+	}
+
+	reader->fd = device_open_channel(reader, reader->channel);
+	if (!VALID_DEVICE_HANDLE(reader->fd))
+	{
+		return -1;
+	}
+
+	if (ioctl(reader->fd, ADC_IOC_SET_MODE, &mode) != 0)
+	{
+		int error_number = errno;
+		CLOSE_INVALIDATE(reader->fd);
+		errno = error_number;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int device_read_text(struct Reader* reader, struct Result* results)
+{
+	char buffer[TEXT_BUFFER];
+	int fd = reader->fd;
+	ssize_t length;
+
+	if (reader->params->mode == MODE_ASCII)
+	{
+		fd = device_open_channel(reader, reader->channel);
+		if (!VALID_DEVICE_HANDLE(fd))
+		{
+			return -1;
+		}
+	}
+
+	length = read(fd, buffer, sizeof(buffer) - 1);
+
+	if (reader->params->mode == MODE_ASCII)
+	{
+		int error_number = errno;
+		close(fd);
+		errno = error_number;
+	}
+
+	if (length <= 0)
+	{
+		if (length == 0)
+		{
+			errno = ENODATA;
+		}
+		return -1;
+	}
+
+	buffer[length] = '\0';
+	memset(&results[0], 0, sizeof(struct Result));
+	results[0].channel = reader->channel;
+
+	if (!parse_value(buffer, &results[0].value))
+	{
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 1;
+}
+
+static int device_read_stream(struct Reader* reader, struct Result* results)
+{
+	struct AdcSample samples[STREAM_SAMPLES];
+	ssize_t length = read(reader->fd, samples, sizeof(samples));
+	int count;
+
+	if (length < 0)
+	{
+		return -1;
+	}
+
+	count = length / sizeof(struct AdcSample);
+	for (int i = 0; i < count; ++i)
+	{
+		results[i].channel = samples[i].channel;
+		results[i].value = samples[i].value;
+		results[i].timestamp = samples[i].timestamp;
+		results[i].tagged = true;
+		results[i].sequence = samples[i].sequence;
+	}
+
+	return count;
+}
+
+static int device_read_scan(struct Reader* reader, struct Result* results)
+{
+	struct AdcScan scan;
+	int count = 0;
+
+	if (read(reader->fd, &scan, sizeof(scan)) != sizeof(scan))
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		if ((reader->params->channels & (1u << i)) != 0)
+		{
+			memset(&results[count], 0, sizeof(struct Result));
+			results[count].channel = i;
+			results[count].value = scan.values[i];
+			results[count].timestamp = scan.timestamp;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static int device_read_batch(struct Reader* reader, struct Result* results)
+{
+	struct AdcBatch batch;
+	int count;
+
+	memset(&batch, 0, sizeof(batch));
+	for (int i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		if ((reader->params->channels & (1u << i)) != 0)
+		{
+			batch.channels[batch.count++] = i;
+		}
+	}
+
+	batch.repeat = reader->params->batch_repeat;
+	batch.values = (unsigned long)reader->batch_values;
+
+	if (ioctl(reader->fd, ADC_IOC_BATCH, &batch) != 0)
+	{
+		return -1;
+	}
+
+	count = batch.count * batch.repeat;
+	for (int i = 0; i < count; ++i)
+	{
+		memset(&results[i], 0, sizeof(struct Result));
+		results[i].channel = batch.channels[i % batch.count];
+		results[i].value = reader->batch_values[i];
+		// only the last conversion has a timestamp, checking it is enough to see the batch is fresh
+		results[i].timestamp = i == count - 1 ? (long long)batch.timestamp : 0;
+	}
+
+	return count;
+}
+
+static int device_read(struct Reader* reader, struct Result* results, long long start)
+{
+	switch (reader->params->mode)
+	{
+	case MODE_STREAM:
+		return device_read_stream(reader, results);
+	case MODE_SCAN:
+		return device_read_scan(reader, results);
+	case MODE_BATCH:
+		return device_read_batch(reader, results);
+	default:
+		return device_read_text(reader, results);
+	}
+}
+
+static void device_close(struct Reader* reader)
+{
+	if (VALID_DEVICE_HANDLE(reader->fd))
+	{
+		CLOSE_INVALIDATE(reader->fd);
+	}
+}
+
+static const struct Backend device_backend = { "device", device_open, device_read, device_close };
+
+/*
+ * Simulated backend, a single converter shared by all threads that needs conversion_ns
+ * per conversion. Channel n produces a triangle wave within its own band of values, so
+ * results of the wrong channel stand out, fault_rate of the results are wrong on purpose.
+ */
+
+static pthread_mutex_t sim_converter = PTHREAD_MUTEX_INITIALIZER;
+static long long sim_cache_time[ADC_NUMCHANNELS];
+static int sim_cache_value[ADC_NUMCHANNELS];
+static unsigned int sim_sequence[ADC_NUMCHANNELS];  // one per channel like the sample ring of the driver
+
+static int sim_signal(int channel, long long time)
+{
+	long long phase = time % SIM_PERIOD_NS;
+	long long amplitude = SIM_BAND - 1;
+
+	if (phase >= SIM_PERIOD_NS / 2)
+	{
+		phase = SIM_PERIOD_NS - phase;
+	}
+
+	return channel * SIM_BAND + (int)(phase * 2 * amplitude / SIM_PERIOD_NS);
+}
+
+static bool sim_fault(struct Reader* reader)
+{
+	return reader->params->fault_rate > 0 && rand_r(&reader->sim_seed) < reader->params->fault_rate * ((double)RAND_MAX + 1);
+}
+
+// Must be called with sim_converter held
+static void sim_convert(struct Reader* reader, int channel, struct Result* result)
+{
+	long long end = now_ns() + reader->params->conversion_ns;
+	long long time;
+
+	while ((time = now_ns()) < end)
+	{
+	}
+
+	memset(result, 0, sizeof(struct Result));
+	result->channel = channel;
+	result->value = sim_signal(channel, time);
+	result->timestamp = time;
+
+	if (sim_fault(reader))
+	{
+		result->value = sim_signal((channel + 1) % ADC_NUMCHANNELS, time);
+	}
+
+	if (sim_fault(reader))
+	{
+		result->timestamp = sim_cache_time[channel];
+	}
+
+	sim_cache_time[channel] = time;
+	sim_cache_value[channel] = result->value;
+}
+
+static int sim_open(struct Reader* reader)
+{
+	reader->sim_seed = reader->index + 1;
+	return 0;
+}
+
+static int sim_read(struct Reader* reader, struct Result* results, long long start)
+{
+	int count = 0;
+
+	pthread_mutex_lock(&sim_converter);
+
+	switch (reader->params->mode)
+	{
+	case MODE_CACHED:
+		if (sim_cache_time[reader->channel] != 0 && start - sim_cache_time[reader->channel] <= reader->params->max_age_ns)
+		{
+			memset(&results[0], 0, sizeof(struct Result));
+			results[0].channel = reader->channel;
+			results[0].value = sim_cache_value[reader->channel];
+		}
+		else
+		{
+			sim_convert(reader, reader->channel, &results[0]);
+		}
+		count = 1;
+		break;
+
+	case MODE_STREAM:
+		sim_convert(reader, reader->channel, &results[0]);
+		results[0].tagged = true;
+		if (sim_fault(reader))
+		{
+			sim_sequence[reader->channel]++;
+		}
+		results[0].sequence = sim_sequence[reader->channel]++;
+		count = 1;
+		break;
+
+	case MODE_SCAN:
+	case MODE_BATCH:
+		for (int round = 0; round < (reader->params->mode == MODE_BATCH ? reader->params->batch_repeat : 1); ++round)
+		{
+			for (int i = 0; i < ADC_NUMCHANNELS; ++i)
+			{
+				if ((reader->params->channels & (1u << i)) != 0)
+				{
+					sim_convert(reader, i, &results[count++]);
+				}
+			}
+		}
+		break;
+
+	default:
+		sim_convert(reader, reader->channel, &results[0]);
+		count = 1;
+		break;
+	}
+
+	pthread_mutex_unlock(&sim_converter);
+
+	// the text modes do not return a timestamp
+	if (reader->params->mode != MODE_STREAM && reader->params->mode != MODE_SCAN && reader->params->mode != MODE_BATCH)
+	{
+		results[0].timestamp = 0;
+	}
+
+	return count;
+}
+
+static void sim_close(struct Reader* reader)
+{
+}
+
+static const struct Backend sim_backend = { "simulated", sim_open, sim_read, sim_close };
+
+/* Measurement */
+
+// Keeps a uniform sample of all latencies once more than LATENCY_RESERVOIR were seen
+static void latency_record(struct Latencies* latencies, long long latency)
+{
+	unsigned long long slot;
+
+	latencies->seen++;
+
+	if (latencies->count < LATENCY_RESERVOIR)
+	{
+		latencies->values[latencies->count++] = latency;
+		return;
+	}
+
+	slot = (((unsigned long long)rand_r(&latencies->seed) << 31) | rand_r(&latencies->seed)) % latencies->seen;
+	if (slot < LATENCY_RESERVOIR)
+	{
+		latencies->values[slot] = latency;
+	}
+}
+
+/*
+ * A result is wrong if the driver tagged it with another channel or if it is outside the
+ * band of its channel. It is stale if it is not newer than the previous one of its channel
+ * or, for the modes that convert on demand, older than the start of the read.
+ */
+static void check_result(struct Reader* reader, struct Result* result, long long start)
+{
+	int channel = result->channel;
+	struct Band* band;
+
+	if (channel < 0 || channel >= ADC_NUMCHANNELS || (reader->params->mode != MODE_SCAN && reader->params->mode != MODE_BATCH && channel != reader->channel))
+	{
+		reader->wrong_channel++;
+		return;
+	}
+
+	band = &reader->params->bands[channel];
+	if (band->set && (result->value < band->min || result->value > band->max))
+	{
+		reader->out_of_band++;
+	}
+
+	// a thread sees the sequence of a channel rising, the other threads may have read the numbers in between
+	if (result->tagged)
+	{
+		if (!reader->sequence_valid[channel])
+		{
+			reader->sequence_valid[channel] = true;
+			reader->sequence_first[channel] = result->sequence;
+		}
+
+		reader->sequence_last[channel] = result->sequence;
+		reader->sequence_count[channel]++;
+	}
+
+	if (result->timestamp == 0)
+	{
+		return;
+	}
+
+	if (result->timestamp <= reader->last_timestamp[channel] ||
+		((reader->params->mode == MODE_SCAN || reader->params->mode == MODE_BATCH) && result->timestamp < start))
+	{
+		reader->stale++;
+	}
+
+	reader->last_timestamp[channel] = result->timestamp;
+}
+
+static void* reader_run(void* argument)
+{
+	struct Reader* reader = argument;
+	struct Result* results = reader->results;
+
+	if (backend->open(reader) != 0)
+	{
+		reader->errors++;
+		reader->last_error = errno;
+		return NULL;
+	}
+
+	while (!stop)
+	{
+		long long start = now_ns();
+		int count = backend->read(reader, results, start);
+		long long end = now_ns();
+
+		reader->reads++;
+
+		if (count < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			reader->errors++;
+			reader->last_error = errno;
+			continue;
+		}
+
+		latency_record(&reader->latencies, end - start);
+		reader->samples += count;
+
+		for (int i = 0; i < count; ++i)
+		{
+			check_result(reader, &results[i], start);
+		}
+	}
+
+	backend->close(reader);
+	return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+	long long left = *(const long long*)a;
+	long long right = *(const long long*)b;
+
+	return (left > right) - (left < right);
+}
+
+static long long percentile(const long long* sorted, size_t count, double fraction)
+{
+	size_t index;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	index = (size_t)(fraction * (count - 1) + 0.5);
+	return sorted[index];
+}
+
+/* Arguments and output */
+
+void print_usage()
+{
+	fprintf(stderr, "\
+Usage: ./adc-bench [options]\n\
+  -m <mode>      ascii, repeat, cached, millivolt, stream, scan or batch (default: ascii)\n\
+  -t <threads>   reader threads, spread over the channels in the single channel modes (default: 3)\n\
+  -c <channels>  comma separated channel list (default: 0,1,2)\n\
+  -T <seconds>   run time (default: 5)\n\
+  -r <repeat>    rounds per batch in batch mode (default: 8)\n\
+  -e <c:min:max> expected value range of channel c, results outside are counted as out of band\n\
+  -o <format>    text, csv or json (default: text)\n\
+  -d <prefix>    device prefix (default: " DEVICE_PREFIX ")\n\
+  -s             use the simulated converter instead of the device\n\
+  -C <ns>        simulated conversion time (default: 25000)\n\
+  -a <ns>        simulated cache age in cached mode (default: 10000000)\n\
+  -f <fraction>  simulated results that are wrong on purpose, to check the checks (default: 0)\n\
+Exits with 2 if wrong, out of band or stale results were seen and with 1 on read errors.\n\
+Example: ./adc-bench -m stream -t 3 -T 10 -o json\n");
+}
+
+static bool parse_channels(const char* text, unsigned int* mask)
+{
+	char* end;
+
+	*mask = 0;
+	while (*text != '\0')
+	{
+		long channel = strtol(text, &end, 10);
+		if (end == text || channel < 0 || channel >= ADC_NUMCHANNELS)
+		{
+			return false;
+		}
+
+		*mask |= 1u << channel;
+		text = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != '\0')
+		{
+			return false;
+		}
+	}
+
+	return *mask != 0;
+}
+
+static bool parse_band(const char* text, struct Band* bands)
+{
+	int channel;
+	int min;
+	int max;
+
+	if (sscanf(text, "%d:%d:%d", &channel, &min, &max) != 3 || channel < 0 || channel >= ADC_NUMCHANNELS || min > max)
+	{
+		return false;
+	}
+
+	bands[channel].set = true;
+	bands[channel].min = min;
+	bands[channel].max = max;
+	return true;
+}
+
+bool parse_arguments(int argc, char** argv, struct Parameters* params)
+{
+	int option;
+
+	params->device = DEVICE_PREFIX;
+	params->threads = 3;
+	params->channels = (1u << ADC_NUMCHANNELS) - 1;
+	params->duration = 5;
+	params->batch_repeat = 8;
+	params->conversion_ns = 25000;
+	params->max_age_ns = 10000000;
+
+	while ((option = getopt(argc, argv, "m:t:c:T:r:e:o:d:sC:a:f:h")) != -1)
+	{
+		switch (option)
+		{
+		case 'm':
+			params->mode = -1;
+			for (int i = 0; i < MODE_COUNT; ++i)
+			{
+				if (strcmp(optarg, mode_names[i]) == 0)
+				{
+					params->mode = i;
+				}
+			}
+			if (params->mode < 0)
+			{
+				return false;
+			}
+			break;
+		case 't':
+			params->threads = atoi(optarg);
+			if (params->threads < 1 || params->threads > MAX_THREADS)
+			{
+				return false;
+			}
+			break;
+		case 'c':
+			if (!parse_channels(optarg, &params->channels))
+			{
+				return false;
+			}
+			break;
+		case 'T':
+			params->duration = strtod(optarg, NULL);
+			if (params->duration <= 0)
+			{
+				return false;
+			}
+			break;
+		case 'r':
+			params->batch_repeat = atoi(optarg);
+			if (params->batch_repeat < 1)
+			{
+				return false;
+			}
+			break;
+		case 'e':
+			if (!parse_band(optarg, params->bands))
+			{
+				return false;
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+			{
+				params->format = FORMAT_TEXT;
+			}
+			else if (strcmp(optarg, "csv") == 0)
+			{
+				params->format = FORMAT_CSV;
+			}
+			else if (strcmp(optarg, "json") == 0)
+			{
+				params->format = FORMAT_JSON;
+			}
+			else
+			{
+				return false;
+			}
+			break;
+		case 'd':
+			params->device = optarg;
+			break;
+		case 's':
+			params->simulate = true;
+			break;
+		case 'C':
+			params->conversion_ns = atoll(optarg);
+			break;
+		case 'a':
+			params->max_age_ns = atoll(optarg);
+			break;
+		case 'f':
+			params->fault_rate = strtod(optarg, NULL);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc)
+	{
+		return false;
+	}
+
+	if (params->mode == MODE_BATCH && params->batch_repeat > ADC_BATCH_MAX / count_channels(params->channels))
+	{
+		return false;
+	}
+
+	// the simulated channels have known bands unless the user set others
+	for (int i = 0; params->simulate && i < ADC_NUMCHANNELS; ++i)
+	{
+		if (!params->bands[i].set)
+		{
+			params->bands[i].set = true;
+			params->bands[i].min = i * SIM_BAND;
+			params->bands[i].max = (i + 1) * SIM_BAND - 1;
+		}
+	}
+
+	return true;
+}
+
+// Sequence numbers of a channel missing between the first and the last one any thread read
+static unsigned long long count_dropped(struct Reader* readers, int threads)
+{
+	unsigned long long dropped = 0;
+
+	for (int channel = 0; channel < ADC_NUMCHANNELS; ++channel)
+	{
+		bool seen = false;
+		unsigned int first = 0;
+		unsigned int last = 0;
+		unsigned long long count = 0;
+
+		for (int i = 0; i < threads; ++i)
+		{
+			struct Reader* reader = &readers[i];
+
+			if (!reader->sequence_valid[channel])
+			{
+				continue;
+			}
+
+			// the sequence wraps, so compare the distances
+			if (!seen || (int)(reader->sequence_first[channel] - first) < 0)
+			{
+				first = reader->sequence_first[channel];
+			}
+
+			if (!seen || (int)(reader->sequence_last[channel] - last) > 0)
+			{
+				last = reader->sequence_last[channel];
+			}
+
+			seen = true;
+			count += reader->sequence_count[channel];
+		}
+
+		if (seen && (unsigned long long)(last - first) + 1 > count)
+		{
+			dropped += (unsigned long long)(last - first) + 1 - count;
+		}
+	}
+
+	return dropped;
+}
+
+struct Totals
+{
+	unsigned long long reads;
+	unsigned long long samples;
+	unsigned long long errors;
+	unsigned long long wrong_channel;
+	unsigned long long out_of_band;
+	unsigned long long stale;
+	unsigned long long dropped;
+	int last_error;
+	double seconds;
+	size_t latency_count;
+	long long latency[6];   // min, p50, p90, p99, p99.9, max
+};
+
+static const char* latency_names[6] = { "min", "p50", "p90", "p99", "p999", "max" };
+
+static void print_results(struct Parameters* params, struct Totals* totals)
+{
+	char channels[TEXT_BUFFER] = "";
+	double rate = totals->seconds > 0 ? totals->samples / totals->seconds : 0;
+
+	for (int i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		if ((params->channels & (1u << i)) != 0)
+		{
+			snprintf(channels + strlen(channels), sizeof(channels) - strlen(channels), "%s%d", channels[0] == '\0' ? "" : ",", i);
+		}
+	}
+
+	switch (params->format)
+	{
+	case FORMAT_CSV:
+		printf("backend,mode,threads,channels,seconds,reads,samples,samples_per_s,errors,wrong_channel,out_of_band,stale,dropped");
+		for (int i = 0; i < 6; ++i)
+		{
+			printf(",latency_%s_ns", latency_names[i]);
+		}
+		printf("\n%s,%s,%d,\"%s\",%.3f,%llu,%llu,%.1f,%llu,%llu,%llu,%llu,%llu", backend->name, mode_names[params->mode], params->threads, channels,
+			totals->seconds, totals->reads, totals->samples, rate, totals->errors, totals->wrong_channel, totals->out_of_band, totals->stale, totals->dropped);
+		for (int i = 0; i < 6; ++i)
+		{
+			printf(",%lld", totals->latency[i]);
+		}
+		printf("\n");
+		break;
+
+	case FORMAT_JSON:
+		printf("{\"backend\": \"%s\", \"mode\": \"%s\", \"threads\": %d, \"channels\": [%s], \"seconds\": %.3f, ",
+			backend->name, mode_names[params->mode], params->threads, channels, totals->seconds);
+		printf("\"reads\": %llu, \"samples\": %llu, \"samples_per_s\": %.1f, \"errors\": %llu, \"last_error\": \"%s\", ",
+			totals->reads, totals->samples, rate, totals->errors, totals->errors != 0 ? strerror(totals->last_error) : "");
+		printf("\"wrong_channel\": %llu, \"out_of_band\": %llu, \"stale\": %llu, \"dropped\": %llu, \"latency_ns\": {",
+			totals->wrong_channel, totals->out_of_band, totals->stale, totals->dropped);
+		for (int i = 0; i < 6; ++i)
+		{
+			printf("%s\"%s\": %lld", i == 0 ? "" : ", ", latency_names[i], totals->latency[i]);
+		}
+		printf("}}\n");
+		break;
+
+	default:
+		printf("backend %s mode %s threads %d channels %s seconds %.3f\n", backend->name, mode_names[params->mode], params->threads, channels, totals->seconds);
+		printf("reads %llu samples %llu samples_per_s %.1f errors %llu\n", totals->reads, totals->samples, rate, totals->errors);
+		printf("wrong_channel %llu out_of_band %llu stale %llu dropped %llu\n", totals->wrong_channel, totals->out_of_band, totals->stale, totals->dropped);
+		printf("latency_ns");
+		for (int i = 0; i < 6; ++i)
+		{
+			printf(" %s %lld", latency_names[i], totals->latency[i]);
+		}
+		printf("\n");
+		if (totals->errors != 0)
+		{
+			printf("last_error %s\n", strerror(totals->last_error));
+		}
+		break;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	struct Parameters params;
+	struct Reader* readers;
+	struct Totals totals;
+	struct timespec duration;
+	long long* latencies;
+	long long start;
+	int channel;
+
+	memset(&params, 0, sizeof(params));
+	if (!parse_arguments(argc, argv, &params))
+	{
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	backend = params.simulate ? &sim_backend : &device_backend;
+
+	readers = calloc(params.threads, sizeof(struct Reader));
+	latencies = malloc(sizeof(long long) * LATENCY_RESERVOIR * params.threads);
+	if (readers == NULL || latencies == NULL)
+	{
+		perror("out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, inthand);
+	signal(SIGTERM, inthand);
+
+	channel = first_channel(params.channels);
+	start = now_ns();
+
+	for (int i = 0; i < params.threads; ++i)
+	{
+		readers[i].index = i;
+		readers[i].fd = -1;
+		readers[i].params = &params;
+		readers[i].channel = channel;
+		readers[i].latencies.values = latencies + (size_t)i * LATENCY_RESERVOIR;
+		readers[i].latencies.seed = i + 1;
+
+		if (pthread_create(&readers[i].thread, NULL, reader_run, &readers[i]) != 0)
+		{
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+
+		// the next thread reads the next channel of the list
+		do
+		{
+			channel = (channel + 1) % ADC_NUMCHANNELS;
+		} while ((params.channels & (1u << channel)) == 0);
+	}
+
+	duration.tv_sec = (time_t)params.duration;
+	duration.tv_nsec = (long)((params.duration - duration.tv_sec) * NANOSECOND);
+	while (!stop && nanosleep(&duration, &duration) != 0)
+	{
+	}
+	stop = 1;
+
+	memset(&totals, 0, sizeof(totals));
+
+	for (int i = 0; i < params.threads; ++i)
+	{
+		struct Reader* reader = &readers[i];
+
+		pthread_join(reader->thread, NULL);
+
+		totals.reads += reader->reads;
+		totals.samples += reader->samples;
+		totals.errors += reader->errors;
+		totals.wrong_channel += reader->wrong_channel;
+		totals.out_of_band += reader->out_of_band;
+		totals.stale += reader->stale;
+		if (reader->errors != 0)
+		{
+			totals.last_error = reader->last_error;
+		}
+
+		// the reservoirs are kept back to back, so they only need to be moved together
+		memmove(latencies + totals.latency_count, reader->latencies.values, sizeof(long long) * reader->latencies.count);
+		totals.latency_count += reader->latencies.count;
+	}
+
+	totals.seconds = (now_ns() - start) / (double)NANOSECOND;
+	totals.dropped = count_dropped(readers, params.threads);
+
+	qsort(latencies, totals.latency_count, sizeof(long long), compare_latencies);
+	totals.latency[0] = percentile(latencies, totals.latency_count, 0);
+	totals.latency[1] = percentile(latencies, totals.latency_count, 0.5);
+	totals.latency[2] = percentile(latencies, totals.latency_count, 0.9);
+	totals.latency[3] = percentile(latencies, totals.latency_count, 0.99);
+	totals.latency[4] = percentile(latencies, totals.latency_count, 0.999);
+	totals.latency[5] = percentile(latencies, totals.latency_count, 1);
+
+	print_results(&params, &totals);
+
+	free(latencies);
+	free(readers);
+
+	if (totals.wrong_channel != 0 || totals.out_of_band != 0 || totals.stale != 0)
+	{
+		return 2;
+	}
+
+	return totals.errors != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,3 @@
+#!/bin/bash
+crcc=/usr/local/xtools/arm-unknown-linux-uclibcgnueabi/bin/arm-unknown-linux-uclibcgnueabi-
+make ARCH=arm CROSS_COMPILE=$crcc
\ No newline at end of file
@@ -0,0 +1,347 @@
+/*
+ * IIO variant of the ES6_ADC module, for boards that run a current kernel instead of 2.6.34.
+ * It is written against the IIO API of Linux 6.1 and needs CONFIG_IIO, CONFIG_IIO_BUFFER,
+ * CONFIG_IIO_TRIGGERED_BUFFER and, for periodic sampling, CONFIG_IIO_HRTIMER_TRIGGER.
+ *
+ *  - in_voltageN_raw and in_voltage_scale do single conversions, the scale gives millivolts
+ *  - buffered capture goes through the triggered buffer and its kfifo, the scan elements
+ *    are the three channels (u10 in 16 bits) and a timestamp
+ *  - the es6-adc-eint0 trigger fires on every rising edge of EINT0 and is the default trigger
+ *  - a periodic trigger comes from iio-trig-hrtimer:
+ *      mkdir /sys/kernel/config/iio/triggers/hrtimer/adc
+ *      echo 1000 > /sys/bus/iio/devices/trigger*/sampling_frequency   (the one named adc)
+ *      iio_readdev -t adc -s 1000 es6-adc
+ *
+ * It binds to the nxp,lpc3220-adc node in place of the mainline lpc32xx_adc driver, which
+ * must not be loaded at the same time. EINT0 is the optional second interrupt of the node.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/mod_devicetable.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/clk.h>
+#include <linux/io.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Elviro & Rafal");
+MODULE_DESCRIPTION("That's a kernel module wich handles ADC conversion through IIO");
+
+#define DEVICE_NAME  "es6-adc"
+#define ADC_NUMCHANNELS (3)
+
+#define ADC_SELECT_OFFSET         (0x04)
+#define ADC_CTRL_OFFSET           (0x08)
+#define ADC_VALUE_OFFSET          (0x48)
+
+#define ADC_SELECT_START_MASK     (0x30)
+#define ADC_SELECT_SHIFT          (4)
+#define ADC_SELECT_SET_MASK       (0x0280)
+#define ADC_CTRL_MASK             (0x4)
+#define ADC_CTRL_AD_START_MASK    (0x2)
+#define ADC_VALUE_MASK            (0x3FF)
+
+#define ADC_RESOLUTION_BITS (10)
+#define ADC_REFERENCE_MV (3300)
+#define ADC_TIMEOUT_MS (10)
+
+struct Es6Adc
+{
+	void __iomem*       base;
+	struct clk*         clock;
+	struct mutex        lock;      // one conversion at a time, shared by direct reads and the buffer
+	struct completion   done;
+	int                 irq;       // conversion interrupt
+	u16                 value;
+	struct iio_trigger* eint0;
+
+	// one buffer scan, the timestamp must be 8 byte aligned
+	struct
+	{
+		u16 values[ADC_NUMCHANNELS];
+		s64 timestamp __aligned(8);
+	} scan;
+};
+
+#define ES6_ADC_CHANNEL(n)                                        \
+	{                                                             \
+		.type = IIO_VOLTAGE,                                      \
+		.indexed = 1,                                             \
+		.channel = (n),                                           \
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),             \
+		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),     \
+		.scan_index = (n),                                        \
+		.scan_type =                                              \
+		{                                                         \
+			.sign = 'u',                                          \
+			.realbits = ADC_RESOLUTION_BITS,                      \
+			.storagebits = 16,                                    \
+			.endianness = IIO_CPU,                                \
+		},                                                        \
+	}
+
+static const struct iio_chan_spec es6_adc_channels[] =
+{
+	ES6_ADC_CHANNEL(0),
+	ES6_ADC_CHANNEL(1),
+	ES6_ADC_CHANNEL(2),
+	IIO_CHAN_SOFT_TIMESTAMP(ADC_NUMCHANNELS),
+};
+
+static irqreturn_t es6_adc_interrupt (int irq, void * dev_id)
+{
+	struct Es6Adc* adc = dev_id;
+
+	adc->value = readl(adc->base + ADC_VALUE_OFFSET) & ADC_VALUE_MASK;
+	complete(&adc->done);
+
+	return IRQ_HANDLED;
+}
+
+// Must be called with adc->lock held
+static int es6_adc_convert (struct Es6Adc* adc, int channel, u16* value)
+{
+	reinit_completion(&adc->done);
+
+	writel(ADC_SELECT_SET_MASK | ((channel << ADC_SELECT_SHIFT) & ADC_SELECT_START_MASK), adc->base + ADC_SELECT_OFFSET);
+	writel(ADC_CTRL_MASK | ADC_CTRL_AD_START_MASK, adc->base + ADC_CTRL_OFFSET);
+
+	if (wait_for_completion_timeout(&adc->done, msecs_to_jiffies(ADC_TIMEOUT_MS)) == 0)
+	{
+		/*
+		 * Power cycle the converter to drop the conversion and read the value to clear a late
+		 * interrupt, so it cannot complete the next conversion with this channel's value.
+		 */
+		writel(0, adc->base + ADC_CTRL_OFFSET);
+		readl(adc->base + ADC_VALUE_OFFSET);
+		writel(ADC_CTRL_MASK, adc->base + ADC_CTRL_OFFSET);
+		synchronize_irq(adc->irq);
+		return -ETIMEDOUT;
+	}
+
+	*value = adc->value;
+	return 0;
+}
+
+static int es6_adc_read_raw (struct iio_dev * indio_dev, struct iio_chan_spec const * channel, int * val, int * val2, long mask)
+{
+	struct Es6Adc* adc = iio_priv(indio_dev);
+	u16 value;
+	int error;
+
+	switch (mask)
+	{
+	case IIO_CHAN_INFO_RAW:
+		// the buffer owns the converter while it runs
+		error = iio_device_claim_direct_mode(indio_dev);
+		if (error != 0)
+		{
+			return error;
+		}
+
+		mutex_lock(&adc->lock);
+		error = es6_adc_convert(adc, channel->channel, &value);
+		mutex_unlock(&adc->lock);
+
+		iio_device_release_direct_mode(indio_dev);
+
+		if (error != 0)
+		{
+			return error;
+		}
+
+		*val = value;
+		return IIO_VAL_INT;
+
+	case IIO_CHAN_INFO_SCALE:
+		*val = ADC_REFERENCE_MV;
+		*val2 = ADC_RESOLUTION_BITS;
+		return IIO_VAL_FRACTIONAL_LOG2;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct iio_info es6_adc_info =
+{
+	.read_raw = es6_adc_read_raw,
+};
+
+// Converts the enabled channels back to back on every trigger and pushes them as one scan
+static irqreturn_t es6_adc_trigger_handler (int irq, void * p)
+{
+	struct iio_poll_func* pf = p;
+	struct iio_dev* indio_dev = pf->indio_dev;
+	struct Es6Adc* adc = iio_priv(indio_dev);
+	bool converted = true;
+	int channel;
+	int i = 0;
+
+	mutex_lock(&adc->lock);
+
+	for_each_set_bit(channel, indio_dev->active_scan_mask, indio_dev->masklength)
+	{
+		if (es6_adc_convert(adc, channel, &adc->scan.values[i++]) != 0)
+		{
+			converted = false;
+			break;
+		}
+	}
+
+	if (converted)
+	{
+		iio_push_to_buffers_with_timestamp(indio_dev, &adc->scan, pf->timestamp);
+	}
+
+	mutex_unlock(&adc->lock);
+
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+// EINT0 is optional, without it the buffer runs on the hrtimer or any other trigger
+static int es6_adc_setup_eint0 (struct platform_device * pdev, struct iio_dev * indio_dev)
+{
+	struct Es6Adc* adc = iio_priv(indio_dev);
+	int irq = platform_get_irq_optional(pdev, 1);
+	int error;
+
+	if (irq <= 0)
+	{
+		dev_info(&pdev->dev, "no EINT0 interrupt, the eint0 trigger is not available\n");
+		return 0;
+	}
+
+	adc->eint0 = devm_iio_trigger_alloc(&pdev->dev, "%s-eint0", indio_dev->name);
+	if (adc->eint0 == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	error = devm_request_irq(&pdev->dev, irq, iio_trigger_generic_data_rdy_poll, IRQF_TRIGGER_RISING, DEVICE_NAME "-eint0", adc->eint0);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	error = devm_iio_trigger_register(&pdev->dev, adc->eint0);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	indio_dev->trig = iio_trigger_get(adc->eint0);
+	return 0;
+}
+
+static void es6_adc_clock_disable (void * clock)
+{
+	clk_disable_unprepare(clock);
+}
+
+static int es6_adc_probe (struct platform_device * pdev)
+{
+	struct device* dev = &pdev->dev;
+	struct iio_dev* indio_dev;
+	struct Es6Adc* adc;
+	int irq;
+	int error;
+
+	indio_dev = devm_iio_device_alloc(dev, sizeof(struct Es6Adc));
+	if (indio_dev == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	adc = iio_priv(indio_dev);
+	mutex_init(&adc->lock);
+	init_completion(&adc->done);
+
+	adc->base = devm_platform_ioremap_resource(pdev, 0);
+	if (IS_ERR(adc->base))
+	{
+		return PTR_ERR(adc->base);
+	}
+
+	adc->clock = devm_clk_get(dev, NULL);
+	if (IS_ERR(adc->clock))
+	{
+		return dev_err_probe(dev, PTR_ERR(adc->clock), "no ADC clock\n");
+	}
+
+	error = clk_prepare_enable(adc->clock);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	error = devm_add_action_or_reset(dev, es6_adc_clock_disable, adc->clock);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	// power the converter up once, every conversion only strobes it
+	writel(ADC_CTRL_MASK, adc->base + ADC_CTRL_OFFSET);
+
+	irq = platform_get_irq(pdev, 0);
+	if (irq < 0)
+	{
+		return irq;
+	}
+	adc->irq = irq;
+
+	error = devm_request_irq(dev, irq, es6_adc_interrupt, 0, DEVICE_NAME, adc);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	indio_dev->name = DEVICE_NAME;
+	indio_dev->info = &es6_adc_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = es6_adc_channels;
+	indio_dev->num_channels = ARRAY_SIZE(es6_adc_channels);
+
+	error = devm_iio_triggered_buffer_setup(dev, indio_dev, iio_pollfunc_store_time, es6_adc_trigger_handler, NULL);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	error = es6_adc_setup_eint0(pdev, indio_dev);
+	if (error != 0)
+	{
+		return error;
+	}
+
+	return devm_iio_device_register(dev, indio_dev);
+}
+
+static const struct of_device_id es6_adc_match[] =
+{
+	{ .compatible = "nxp,lpc3220-adc" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, es6_adc_match);
+
+static struct platform_driver es6_adc_driver =
+{
+	.probe = es6_adc_probe,
+	.driver =
+	{
+		.name = DEVICE_NAME,
+		.of_match_table = es6_adc_match,
+	},
+};
+
+module_platform_driver(es6_adc_driver);
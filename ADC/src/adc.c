@@ -7,18 +7,37 @@
 #include <linux/io.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
-#include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/device.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/seqlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
 #include <asm/uaccess.h>
 #include <mach/hardware.h>
 #include <mach/platform.h>
 #include <mach/irqs.h>
 
+#include "adc_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "adc_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Elviro & Rafal");
 MODULE_DESCRIPTION("That's a kernel module wich handles ADC conversion");
 
 #define DEVICE_NAME  "ES6_ADC"
-#define ADC_NUMCHANNELS (3)
 #define bool char
 #define true  (1)
 #define false (0)
@@ -32,6 +51,8 @@ MODULE_DESCRIPTION("That's a kernel module wich handles ADC conversion");
 #define SIC2_ATR        	io_p2v(LPC32XX_SIC2_BASE + 0x10)
 
 #define ADCLK_CTRL1_MASK          (0x01ff)
+#define ADCLK_CTRL1_PERIPH_SELECT (0x0100)  // clocked by PERIPH_CLK / (divider + 1) instead of the 32 kHz RTC clock
+#define ADCLK_CTRL1_DIVIDER_MASK  (0x00ff)
 #define ADC_SELECT_START_MASK     (0x30)
 #define ADC_SELECT_SHIFT          (4)
 #define ADC_SELECT_RESET_MASK     (0x03c0)
@@ -44,29 +65,387 @@ MODULE_DESCRIPTION("That's a kernel module wich handles ADC conversion");
 #define MAX_BUFFER   (256)
 #define NULL_BYTE_ENDING (1)
 
+#define ADC_RING_MASK (ADC_RING_SIZE - 1)
+
+// Request ids: single conversions use the channel number, followed by a scan, a trigger, a batch and the timed samples of every channel
+#define ADC_REQUEST_SCAN    (ADC_NUMCHANNELS)
+#define ADC_REQUEST_TRIGGER (ADC_NUMCHANNELS + 1)
+#define ADC_REQUEST_BATCH   (ADC_NUMCHANNELS + 2)
+#define ADC_REQUEST_TIMED   (ADC_NUMCHANNELS + 3)
+#define ADC_REQUESTS        (ADC_REQUEST_TIMED + ADC_NUMCHANNELS)
+
+#define ADC_CHANNEL_MASK   ((1 << ADC_NUMCHANNELS) - 1)
+#define ADC_TRIGGER_EVENTS (64) // trigger events kept for readers in trigger mode
+#define ADC_TRIGGER_DEPTH_MAX (64)
+
+#define LATENCY_BUCKETS (32)
+
+#define ADC_CONVERSIONS (32) // conversions latched by adc_interrupt that completion_tasklet has not handed out yet
+
+// What a latched conversion still needs from completion_tasklet
+#define CONVERSION_STREAM       (0x1) // goes to the sample ring of its channel
+#define CONVERSION_SCAN_DONE    (0x2) // last channel of a scan, scan_result is already updated
+#define CONVERSION_TRIGGER      (0x4) // belongs to the trigger taken at trigger_timestamp
+#define CONVERSION_TRIGGER_DONE (0x8) // last channel of that trigger
+#define CONVERSION_BATCH_DONE   (0x10) // last conversion of a batch, batch_values is complete
+#define CONVERSION_TIMEOUT      (0x20) // no value, only wakes the readers of a request that timed out
+
+// Readers completion_tasklet still has to wake, the channels use their own bits
+#define WAKE_SCAN  (1 << ADC_NUMCHANNELS)
+#define WAKE_BATCH (1 << (ADC_NUMCHANNELS + 1))
+
+#define ADC_MIN_PERIOD_NS (20000)
+#define ADC_MAX_OVERSAMPLING (256)
+#define ADC_MIN_CLOCK_DIVIDER (3)    // 13 MHz PERIPH_CLK / 3 is the last clock within the 4.5 MHz of the converter
+#define ADC_MAX_CLOCK_DIVIDER (256)
+#define ADC_MAX_AUTOSUSPEND_MS (60000)
+#define CHARACTERISE_CONVERSIONS (256)
+#define ADC_DEFAULT_MAX_AGE_NS (10000000)
+#define ADC_WINDOW_EVENTS (32)  // crossings kept per channel for readers in window mode
+
+#define ADC_CODES (ADC_VALUE_MASK + 1)
+#define ADC_CALIBRATION_POINTS (32)
+#define ADC_REFERENCE_MV (3300)
+#define ADC_CALIBRATION_MAX_MV (100000)  // keeps the interpolation of calibration_build and calibrate within an int
+
+#define ADC_CAPTURE_MASK (ADC_CAPTURE_SAMPLES - 1)
+
 struct MessageData
 {
     int length;
     int channel;
+    int mode;
+    bool pending;              // a non-blocking conversion was issued and not read yet
+    unsigned int generation;   // completion count at the time it was issued
+    int async_fd;              // -1 unless O_ASYNC is set, the fasync entry follows the mode
     char buffer[MAX_BUFFER];
 };
 
+// Measured spacing of the timed samples, intervals and jitter in nanoseconds
+struct RateStatistics
+{
+	u64 samples;
+	u64 missed;       // timer ticks that found the previous sample still queued
+	s64 first;
+	s64 last;
+	s64 interval_min;
+	s64 interval_max;
+	u64 jitter_total; // sum of the absolute deviations from the period
+	s64 jitter_max;
+};
+
+// All conversions of a channel, the sums are exact so mean and variance are only rounded when shown
+struct ValueStatistics
+{
+	u64 count;
+	u64 sum;
+	u64 sum_squares;
+	u16 min;
+	u16 max;
+};
+
+struct CalibrationPoint
+{
+	int code;
+	int millivolts;
+};
+
+// Latencies in nanoseconds, bucket i counts the ones in [2^(i-1), 2^i)
+struct LatencyHistogram
+{
+	u64 count;
+	u64 total;
+	u64 min;
+	u64 max;
+	u32 buckets[LATENCY_BUCKETS];
+};
+
+// Result of one conversion as latched by adc_interrupt
+struct Conversion
+{
+	ktime_t       timestamp;
+	s64           trigger_timestamp;
+	unsigned char channel;
+	unsigned char flags;
+	u16           value;
+};
+
+// Threshold comparator of a channel, evaluated on its streamed samples with adc_lock held
+struct WindowComparator
+{
+	bool              enabled;
+	int               low;
+	int               high;
+	int               hysteresis;
+	int               state;        // enum AdcWindowState
+	struct AdcWindowEvent events[ADC_WINDOW_EVENTS];
+	unsigned int      first;
+	unsigned int      count;
+	unsigned int      sequence;
+	wait_queue_head_t wait;         // only woken up on crossings
+	struct fasync_struct* async_queue;  // descriptors in window mode, signalled on crossings as well
+};
+
+/*
+ * Oscilloscope capture of a channel, history keeps the latest streamed samples until
+ * gp_interrupt arms a trigger. Once post samples at or after the trigger came in the
+ * window is copied to block and kept there until a reader took it. adc_lock protects
+ * everything but block while ready is set, then it belongs to the readers.
+ */
+struct CaptureWindow
+{
+	unsigned int      pre;          // as configured in sysfs, taken over by the next trigger
+	unsigned int      post;
+	int               users;        // descriptors in capture mode
+	struct AdcSample  history[ADC_CAPTURE_SAMPLES];
+	unsigned int      head;
+	unsigned int      filled;
+	bool              triggered;
+	unsigned int      collected;    // samples since the trigger
+	unsigned int      trigger_head; // history index of the first of them
+	unsigned int      triggers;
+	bool              ready;
+	struct AdcCapture block;
+	wait_queue_head_t wait;
+	struct fasync_struct* async_queue;  // descriptors in capture mode, signalled once a capture is ready
+};
+
+/*
+ * The sample ring is filled by adc_interrupt and drained either by read() in stream mode
+ * or directly by a process that mapped it. Since the header is writable from userspace
+ * the driver keeps its own copy of head and only ever trusts the masked indices.
+ */
+struct ChannelData
+{
+	void*                 ring;
+	struct AdcRingHeader* header;
+	struct AdcSample*     samples;
+	unsigned int          head;
+	struct mutex      read_lock;
+	wait_queue_head_t wait;
+	struct fasync_struct* async_queue;
+	unsigned int      sequence;
+	unsigned int      completed;
+	unsigned int      failed;       // the completion count of the last single conversion that timed out
+	int               stream_users;
+	int               number;
+	struct device*    device;
+	u64               period_ns;    // 0 samples as fast as the converter allows
+	struct hrtimer    timer;
+	bool              timer_running;
+	struct mutex      timer_lock;
+	struct RateStatistics rate;
+	struct ValueStatistics statistics;
+	unsigned int      oversampling; // conversions per single conversion request, power of two
+	seqlock_t         cache_lock;   // the last result, its time and max_age_ns for the readers in cached mode
+	int               cache_value;
+	s64               cache_time;   // 0 until the first result
+	u64               max_age_ns;
+	struct WindowComparator window;
+	struct CaptureWindow capture;
+	unsigned int      extra_bits;   // resolution of adc_values beyond the raw 10 bits
+	int               calibration[ADC_CODES];   // millivolts of every raw code
+	struct CalibrationPoint calibration_points[ADC_CALIBRATION_POINTS];
+	int               calibration_count;
+};
+
 static unsigned char adc_channel = 0;
 static int           adc_values[ADC_NUMCHANNELS] = {0, 0, 0};
-static struct        task_struct* current_task = NULL;
+
+static struct ChannelData channels[ADC_NUMCHANNELS];
+static DEFINE_SPINLOCK(adc_lock);      // protects the converter state below and the stream_users counts
+static bool          adc_busy = false;
+static bool          oneshot_in_flight = false;
+static unsigned int  oneshot_left = 0;     // conversions the oversampled single conversion still needs
+static unsigned int  oneshot_sum = 0;
+static unsigned int  oneshot_shift = 0;     // decimates oneshot_sum to 10 + oneshot_bits bits
+static unsigned int  oneshot_bits = 0;
+static bool          stream_in_flight = false;
+static bool          scan_in_flight = false;
+static struct AdcScan scan_progress;
+static struct AdcScan scan_result;
+static unsigned int  scan_completed = 0;
+static unsigned int  scan_failed = 0;
+static DECLARE_WAIT_QUEUE_HEAD(scan_wait);
+
+// Pending conversion requests in arrival order, every request id is queued at most once
+static int           request_queue[ADC_REQUESTS];
+static int           request_first = 0;
+static int           request_count = 0;
+static bool          request_queued[ADC_REQUESTS];
+
+static unsigned int  trigger_channels = 1;
+module_param(trigger_channels, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(trigger_channels, "Bit mask of the channels converted on every EINT0 trigger (default: channel 0)");
+
+static unsigned int  trigger_depth = 16;
+module_param(trigger_depth, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(trigger_depth, "Number of triggers kept while the converter is busy before new ones are dropped (1-64, default: 16)");
+
+// Taken over by adc_start before the next conversion, so a running one is not disturbed
+static unsigned int  clock_divider = 0;
+static bool          clock_changed = false;
+static ktime_t       adc_start_time;
+static struct LatencyHistogram conversion_time;  // start of a conversion to its interrupt
+
+static void clock_divider_update (unsigned int divider)
+{
+	spin_lock_irq(&adc_lock);
+	clock_divider = divider;
+	clock_changed = true;
+	spin_unlock_irq(&adc_lock);
+}
+
+static int clock_divider_set (const char * value, struct kernel_param * parameter)
+{
+	unsigned long divider;
+
+	if (strict_strtoul(value, 10, &divider) != 0 || divider > ADC_MAX_CLOCK_DIVIDER ||
+		(divider != 0 && divider < ADC_MIN_CLOCK_DIVIDER))
+	{
+		return -EINVAL;
+	}
+
+	clock_divider_update(divider);
+	return SUCCESS;
+}
+
+static int clock_divider_get (char * buffer, struct kernel_param * parameter)
+{
+	return sprintf(buffer, "%u", clock_divider);
+}
+
+module_param_call(clock_divider, clock_divider_set, clock_divider_get, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(clock_divider, "ADC clock, 0 for the 32 kHz RTC clock (default) or 3-256 to divide PERIPH_CLK by");
+
+// Armed by adc_start, a conversion without interrupt by then resets the converter and fails its request with -ETIMEDOUT
+static unsigned int  conversion_timeout_ms = 100;
+module_param(conversion_timeout_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(conversion_timeout_ms, "Time in milliseconds a conversion may take before the converter is reset, 0 waits forever (default: 100)");
+
+static struct hrtimer conversion_watchdog;
+static u32           conversion_timeouts = 0;
+
+/*
+ * Autosuspend, the converter is powered down and its clock gated once it has been idle for
+ * autosuspend_delay_ms and woken up again by adc_start. The first conversion after a wake-up
+ * goes to resume_latency, compare it with conversion_time for the price of the delay.
+ */
+static int           autosuspend_delay_ms = -1;
+static bool          autosuspend_armed = false;  // cleared while the driver is not running
+static bool          adc_suspended = false;
+static unsigned long adc_last_busy = 0;          // jiffies when the converter last went idle
+static bool          resume_pending = false;
+static ktime_t       resume_time;
+static u32           suspend_count = 0;
+static struct LatencyHistogram resume_latency;   // power up to the end of the first conversion
+
+static void autosuspend_run (struct work_struct * work);
+static DECLARE_DELAYED_WORK(autosuspend_work, autosuspend_run);
+
+// Must be called with adc_lock held, once the converter went idle
+static void autosuspend_schedule (void)
+{
+	if (!autosuspend_armed || adc_suspended || autosuspend_delay_ms < 0)
+	{
+		return;
+	}
+
+	// a pending work item keeps its expiry, autosuspend_run pushes it out to the last idle time
+	adc_last_busy = jiffies;
+	schedule_delayed_work(&autosuspend_work, msecs_to_jiffies(autosuspend_delay_ms));
+}
+
+static int autosuspend_delay_set (const char * value, struct kernel_param * parameter)
+{
+	long delay;
+
+	if (strict_strtol(value, 10, &delay) != 0 || delay < -1 || delay > ADC_MAX_AUTOSUSPEND_MS)
+	{
+		return -EINVAL;
+	}
+
+	spin_lock_irq(&adc_lock);
+	autosuspend_delay_ms = delay;
+	if (!adc_busy)
+	{
+		autosuspend_schedule();
+	}
+	spin_unlock_irq(&adc_lock);
+
+	return SUCCESS;
+}
+
+static int autosuspend_delay_get (char * buffer, struct kernel_param * parameter)
+{
+	return sprintf(buffer, "%d", autosuspend_delay_ms);
+}
+
+module_param_call(autosuspend_delay_ms, autosuspend_delay_set, autosuspend_delay_get, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Idle time in milliseconds before the converter is powered down, -1 keeps it powered (0-60000, default: -1)");
+
+static bool          trigger_in_flight = false;
+static ktime_t       trigger_times[ADC_TRIGGER_DEPTH_MAX]; // EINT0 times of the triggers waiting for the converter
+static unsigned int  trigger_times_first = 0;
+static unsigned int  trigger_times_count = 0;
+static struct AdcTriggerStats trigger_stats;
+static struct LatencyHistogram trigger_latency;   // EINT0 to completion of the last converted channel
+
+static struct dentry* adc_debugfs = NULL;
+static struct AdcTriggerEvent trigger_progress;    // channels and EINT0 time of the trigger being converted
+static struct AdcTriggerEvent trigger_collected;   // its values as handed out by completion_tasklet
+static struct AdcTriggerEvent trigger_events[ADC_TRIGGER_EVENTS];
+static unsigned int  trigger_first = 0;
+static unsigned int  trigger_count = 0;
+static unsigned int  trigger_sequence = 0;
+static DECLARE_WAIT_QUEUE_HEAD(trigger_wait);
+static struct fasync_struct* trigger_async_queue = NULL;  // descriptors in trigger mode on any channel
+static DEFINE_MUTEX(trigger_read_lock);
+
+/*
+ * adc_interrupt only latches the conversion and restarts the converter, everything else
+ * happens in completion_tasklet with interrupts enabled. Both are protected by adc_lock.
+ */
+static struct Conversion conversions[ADC_CONVERSIONS];
+static unsigned int  conversions_first = 0;
+static unsigned int  conversions_count = 0;
+static u32           conversions_lost = 0;  // latched while the tasklet was starved and the queue full
+static unsigned int  wake_pending = 0;      // WAKE_ bits, kept apart so a lost conversion still wakes its readers
+static struct LatencyHistogram irq_time;    // time spent in adc_interrupt
+
+// The batch of ADC_IOC_BATCH, one at a time since the results are collected in batch_values
+static DEFINE_MUTEX(batch_lock);
+static bool          batch_in_flight = false;
+static unsigned char batch_channels[ADC_BATCH_CHANNELS];
+static unsigned int  batch_count = 0;
+static unsigned int  batch_length = 0;
+static unsigned int  batch_index = 0;
+static u16           batch_values[ADC_BATCH_MAX];
+static s64           batch_timestamp = 0;
+static unsigned int  batch_completed = 0;
+static unsigned int  batch_failed = 0;
+static DECLARE_WAIT_QUEUE_HEAD(batch_wait);
+
+static void completion_run (unsigned long unused);
+static DECLARE_TASKLET(completion_tasklet, completion_run, 0);
 
 static irqreturn_t  adc_interrupt (int irq, void * dev_id);
+static enum hrtimer_restart conversion_watchdog_run (struct hrtimer * timer);
 static irqreturn_t  gp_interrupt  (int irq, void * dev_id);
-struct semaphore channel_conversion;
 
 dev_t          deviceP;
 struct cdev    cDevices;
+struct class*  adc_class;
 
 void cleanup_adc_module(void);
 int init_adc_module (void);
 static int dev_release (struct inode * inode, struct file * file);
 static int dev_open (struct inode * inode, struct file * file);
 static ssize_t dev_read (struct file * file, char __user * buf, size_t length, loff_t * f_pos);
+static long dev_ioctl (struct file * file, unsigned int command, unsigned long argument);
+static int dev_mmap (struct file * file, struct vm_area_struct * vma);
+static unsigned int dev_poll (struct file * file, poll_table * wait);
+static int dev_fasync (int fd, struct file * file, int on);
 static irqreturn_t gp_interrupt(int irq, void * dev_id);
 static irqreturn_t adc_interrupt (int irq, void * dev_id);
 static void adc_init (void);
@@ -77,20 +456,83 @@ static struct file_operations fops =
    .owner = THIS_MODULE,
    .open = dev_open,
    .read = dev_read,
+   .unlocked_ioctl = dev_ioctl,
+   .mmap = dev_mmap,
+   .poll = dev_poll,
+   .fasync = dev_fasync,
    .release = dev_release,
 };
 
+static void adc_clock_apply (void)
+{
+	unsigned long data = ioread32(ADCLK_CTRL1) & ~ADCLK_CTRL1_MASK;
+
+	if (clock_divider != 0)
+	{
+		data |= ADCLK_CTRL1_PERIPH_SELECT | ((clock_divider - 1) & ADCLK_CTRL1_DIVIDER_MASK);
+	}
+
+	iowrite32(data, ADCLK_CTRL1);
+}
+
+static void adc_power (bool on)
+{
+	if (on)
+	{
+		iowrite32(ioread32(ADCLK_CTRL) | LPC32XX_CLKPWR_ADC32CLKCTRL_CLK_EN, ADCLK_CTRL);
+		iowrite32(ioread32(ADC_CTRL) | ADC_CTRL_MASK, ADC_CTRL);
+	}
+	else
+	{
+		iowrite32(ioread32(ADC_CTRL) & ~ADC_CTRL_MASK, ADC_CTRL);
+		iowrite32(ioread32(ADCLK_CTRL) & ~LPC32XX_CLKPWR_ADC32CLKCTRL_CLK_EN, ADCLK_CTRL);
+	}
+}
+
+// Drops a conversion that never finished, reading the value clears a late interrupt
+static void adc_reset (void)
+{
+	iowrite32(ioread32(ADC_CTRL) & ~(ADC_CTRL_MASK | ADC_CTRL_AD_START_MASK), ADC_CTRL);
+	ioread32(ADC_VALUE);
+	iowrite32(ioread32(ADC_CTRL) | ADC_CTRL_MASK, ADC_CTRL);
+}
+
+static void autosuspend_run (struct work_struct * work)
+{
+	unsigned long expires;
+
+	spin_lock_irq(&adc_lock);
+
+	if (autosuspend_armed && !adc_suspended && !adc_busy && autosuspend_delay_ms >= 0)
+	{
+		expires = adc_last_busy + msecs_to_jiffies(autosuspend_delay_ms);
+		if (time_before(jiffies, expires))
+		{
+			schedule_delayed_work(&autosuspend_work, expires - jiffies);
+		}
+		else
+		{
+			adc_power(false);
+			adc_suspended = true;
+			suspend_count++;
+		}
+	}
+
+	spin_unlock_irq(&adc_lock);
+}
+
 static void adc_init (void)
 {
 	unsigned long data;
+
+	hrtimer_init(&conversion_watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	conversion_watchdog.function = conversion_watchdog_run;
   
     data = ioread32(ADCLK_CTRL);
     data |= LPC32XX_CLKPWR_ADC32CLKCTRL_CLK_EN;
     iowrite32 (data, ADCLK_CTRL);
 
-    data = ioread32 (ADCLK_CTRL1);
-    data &= ~ADCLK_CTRL1_MASK;
-    iowrite32 (data, ADCLK_CTRL1);
+	adc_clock_apply();
 
     data = ioread32(ADC_SELECT);
     data &= ~ADC_SELECT_RESET_MASK;
@@ -114,6 +556,11 @@ static void adc_init (void)
     {
         printk (KERN_ALERT DEVICE_NAME ": GP IRQ request failed\n");
     }
+
+	spin_lock_irq(&adc_lock);
+	autosuspend_armed = true;
+	autosuspend_schedule();
+	spin_unlock_irq(&adc_lock);
 }
 
 static void adc_start (unsigned char channel)
@@ -125,153 +572,2647 @@ static void adc_start (unsigned char channel)
         channel = 0;
     }
 
+	if (adc_suspended)
+	{
+		adc_power(true);
+		adc_suspended = false;
+		resume_pending = true;
+		resume_time = ktime_get();
+	}
+
+	if (clock_changed)
+	{
+		adc_clock_apply();
+		clock_changed = false;
+	}
+
 	data = ioread32 (ADC_SELECT);
 
 	iowrite32((data & ~ADC_SELECT_START_MASK) | ((channel << ADC_SELECT_SHIFT) & ADC_SELECT_START_MASK), ADC_SELECT);
 
 	adc_channel = channel;
-    printk(KERN_DEBUG DEVICE_NAME ": adc_start\n");
+	adc_busy = true;
+	adc_start_time = ktime_get();
+	trace_adc_start(channel);
+
+	if (conversion_timeout_ms != 0)
+	{
+		hrtimer_start(&conversion_watchdog, ns_to_ktime((u64)conversion_timeout_ms * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+	}
 
 	data = ioread32(ADC_CTRL);
 	data |= ADC_CTRL_AD_START_MASK;
 	iowrite32(data, ADC_CTRL);
 }
 
-static irqreturn_t adc_interrupt (int irq, void * dev_id)
+// Both must be called with adc_lock held
+static void request_enqueue (int request)
 {
-    adc_values[adc_channel] = ioread32(ADC_VALUE) & ADC_VALUE_MASK;
-    printk(KERN_DEBUG DEVICE_NAME ": adc_interrupt(%d)=%d\n", adc_channel, adc_values[adc_channel]);
-
-    if(current_task != NULL)
-    {
-        wake_up_process(current_task);
-        current_task = NULL;
-    }
-	else
+	if (request_queued[request])
 	{
-		up(&channel_conversion);
+		return;
 	}
 
-    return (IRQ_HANDLED);
+	request_queued[request] = true;
+	request_queue[(request_first + request_count) % ADC_REQUESTS] = request;
+	request_count++;
 }
 
-static irqreturn_t gp_interrupt(int irq, void * dev_id)
+static int request_dequeue (void)
 {
-    printk(KERN_INFO DEVICE_NAME ": gp_interrupt\n");
+	int request;
 
-	if (down_trylock(&channel_conversion) == 0)
+	if (request_count == 0)
 	{
-		adc_start(0);
+		return -1;
 	}
 
-    return (IRQ_HANDLED);
+	request = request_queue[request_first];
+	request_first = (request_first + 1) % ADC_REQUESTS;
+	request_count--;
+	request_queued[request] = false;
+
+	return request;
 }
 
-static void adc_exit (void)
+// Returns the first channel in mask after the given one, or -1 if there is none
+static int next_channel (unsigned int mask, int after)
 {
-    printk(KERN_DEBUG DEVICE_NAME ": adc_exit\n");
-    free_irq (IRQ_LPC32XX_TS_IRQ, NULL);
-    free_irq (IRQ_LPC32XX_GPI_01, NULL);
-}
+	int channel;
+
+	for (channel = after + 1; channel < ADC_NUMCHANNELS; ++channel)
+	{
+		if ((mask & (1 << channel)) != 0)
+		{
+			return channel;
+		}
+	}
 
+	return -1;
+}
 
-static ssize_t dev_read (struct file * file, char __user * buffer, size_t len, loff_t * offset)
+/*
+ * Picks the next conversion once the converter is idle, must be called with adc_lock held.
+ * It runs from adc_interrupt as well, so queued requests are serviced back to back
+ * without waiting for the readers to be scheduled. A running scan, trigger or batch is
+ * continued on its next channel, then queued requests go first, otherwise the streaming channels are
+ * sampled round robin.
+ */
+static void adc_next_conversion (void)
 {
-    int current_offset;
-	int dataLength;
-	int bytesLeft;
-	int written;
-	int value;
+	int i;
+	int channel;
+	int request;
 
-	struct MessageData* data = file->private_data;
+	if (adc_busy)
+	{
+		return;
+	}
 
-    if (*offset == 0)
-    {
-        printk (KERN_DEBUG DEVICE_NAME ": device_read(%d)\n", data->channel);
+	if (scan_in_flight)
+	{
+		adc_start(adc_channel + 1);
+		return;
+	}
 
-        if (data->channel < 0 || data->channel >= ADC_NUMCHANNELS)
-        {
-            return -EFAULT;
-        }
+	if (trigger_in_flight)
+	{
+		adc_start(next_channel(trigger_progress.channels, adc_channel));
+		return;
+	}
 
-		down(&channel_conversion);
+	if (batch_in_flight)
+	{
+		adc_start(batch_channels[batch_index % batch_count]);
+		return;
+	}
 
-        current_task = current;
-        set_current_state(TASK_INTERRUPTIBLE);
-        adc_start (data->channel);
-        schedule();
-		value = adc_values[data->channel];
+	if (oneshot_in_flight)
+	{
+		adc_start(adc_channel);
+		return;
+	}
 
-		up(&channel_conversion);
+	request = request_dequeue();
 
-        data->length = snprintf(data->buffer, MAX_BUFFER, "%d", value) + NULL_BYTE_ENDING;
-    }
+	if (request == ADC_REQUEST_TRIGGER && trigger_times_count > 0)
+	{
+		memset(&trigger_progress, 0, sizeof(struct AdcTriggerEvent));
+		trigger_progress.trigger_timestamp = ktime_to_ns(trigger_times[trigger_times_first]);
+		trigger_times_first = (trigger_times_first + 1) % ADC_TRIGGER_DEPTH_MAX;
+		trigger_times_count--;
 
-    current_offset = *offset;
-	dataLength = data->length- current_offset;
+		trigger_progress.channels = trigger_channels & ADC_CHANNEL_MASK;
+		if (trigger_progress.channels == 0)
+		{
+			trigger_progress.channels = 1;
+		}
 
-	bytesLeft = copy_to_user(buffer, data->buffer + current_offset, dataLength);
-	written = dataLength - bytesLeft;
-	*offset = current_offset + written;
+		trigger_in_flight = true;
+		adc_start(next_channel(trigger_progress.channels, -1));
+		return;
+	}
 
-	return written;
+	if (request == ADC_REQUEST_BATCH)
+	{
+		batch_in_flight = true;
+		batch_index = 0;
+		adc_start(batch_channels[0]);
+		return;
+	}
+
+	if (request == ADC_REQUEST_SCAN)
+	{
+		scan_in_flight = true;
+		adc_start(0);
+		return;
+	}
+
+	if (request >= ADC_REQUEST_TIMED)
+	{
+		stream_in_flight = true;
+		adc_start(request - ADC_REQUEST_TIMED);
+		return;
+	}
+
+	if (request >= 0)
+	{
+		oneshot_in_flight = true;
+		oneshot_left = channels[request].oversampling;
+		oneshot_bits = ilog2(oneshot_left) / 2;
+		oneshot_shift = ilog2(oneshot_left) - oneshot_bits;
+		oneshot_sum = 0;
+		adc_start(request);
+		return;
+	}
+
+	// channels with a sampling period are paced by their timer instead
+	for (i = 1; i <= ADC_NUMCHANNELS; ++i)
+	{
+		channel = (adc_channel + i) % ADC_NUMCHANNELS;
+		if (channels[channel].stream_users > 0 && channels[channel].period_ns == 0)
+		{
+			stream_in_flight = true;
+			adc_start(channel);
+			return;
+		}
+	}
+
+	autosuspend_schedule();
 }
 
-static int dev_open (struct inode * inode, struct file * file)
+/*
+ * Records between tail and head. The tail is written by userspace, one that claims more
+ * than a full ring is corrupt and is moved up to head, dropping the records in between.
+ */
+static unsigned int ring_available (struct ChannelData* data)
 {
-    struct MessageData* data;
-    int channel = iminor(file->f_dentry->d_inode);
+	unsigned int head = ACCESS_ONCE(data->head);
+	unsigned int available = head - ACCESS_ONCE(data->header->tail);
 
-    file->private_data = kmalloc(sizeof(struct MessageData), GFP_KERNEL);
+	if (available > ADC_RING_SIZE)
+	{
+		data->header->tail = head;
+		return 0;
+	}
 
-    if (file == NULL)
-    {
-        return -ENOMEM;
-    }
+	return available;
+}
 
-    data = (struct MessageData*)file->private_data;
-    data->channel = channel;
+static void ring_push (unsigned char channel, int value, ktime_t timestamp)
+{
+	struct ChannelData* data = &channels[channel];
+	struct AdcSample* sample;
 
-    try_module_get(THIS_MODULE);
+	if (ring_available(data) >= ADC_RING_SIZE)
+	{
+		data->header->overruns++;
+		data->sequence++;
+		return;
+	}
 
-	return SUCCESS;
+	sample = &data->samples[data->head & ADC_RING_MASK];
+	sample->timestamp = ktime_to_ns(timestamp);
+	sample->sequence = data->sequence++;
+	sample->channel = channel;
+	sample->value = value;
+
+	// the sample must be visible before the reader sees the new head
+	smp_wmb();
+	data->head++;
+	data->header->head = data->head;
 }
 
-static int dev_release (struct inode* inode, struct file* fileToClose)
+static void rate_update (struct ChannelData* data, s64 now)
 {
-    if (fileToClose->private_data != NULL)
-    {
-        kfree(fileToClose->private_data);
-        fileToClose->private_data = NULL;
-    }
+	struct RateStatistics* rate = &data->rate;
+	s64 interval;
+	s64 deviation;
 
-    printk (KERN_DEBUG DEVICE_NAME ": device_release()\n");
-    module_put(THIS_MODULE);
+	if (rate->samples++ == 0)
+	{
+		rate->first = now;
+		rate->last = now;
+		return;
+	}
 
-	return SUCCESS;
+	interval = now - rate->last;
+	rate->last = now;
+
+	if (rate->samples == 2 || interval < rate->interval_min)
+	{
+		rate->interval_min = interval;
+	}
+
+	if (interval > rate->interval_max)
+	{
+		rate->interval_max = interval;
+	}
+
+	deviation = interval - (s64)data->period_ns;
+	if (deviation < 0)
+	{
+		deviation = -deviation;
+	}
+
+	rate->jitter_total += deviation;
+	if (deviation > rate->jitter_max)
+	{
+		rate->jitter_max = deviation;
+	}
 }
 
-int init_adc_module (void)
+// Must be called with adc_lock held
+static void statistics_update (struct ValueStatistics* statistics, u16 value)
 {
-    int i;
-	int error = alloc_chrdev_region(&deviceP, 0, ADC_NUMCHANNELS, DEVICE_NAME);
+	if (statistics->count == 0 || value < statistics->min)
+	{
+		statistics->min = value;
+	}
 
-	if(error < 0)
+	if (value > statistics->max)
 	{
-		printk(KERN_DEBUG DEVICE_NAME ": dynamic allocation of major number failed, error=%d\n", error);
-		return error;
+		statistics->max = value;
 	}
 
-	printk(KERN_DEBUG DEVICE_NAME ": major number=%d\n", MAJOR(deviceP));
+	statistics->count++;
+	statistics->sum += value;
+	statistics->sum_squares += (u32)value * value;
+}
 
-	cdev_init(&cDevices, &fops);
-	cDevices.owner = THIS_MODULE;
-	cDevices.ops = &fops;
+// Must be called with adc_lock held
+static void latency_record (struct LatencyHistogram* histogram, s64 latency)
+{
+	int bucket;
 
-	error = cdev_add(&cDevices, deviceP, ADC_NUMCHANNELS);
-	if(error < 0)
+	if (latency < 0)
 	{
-		printk(KERN_WARNING DEVICE_NAME ": unable to add device, error=%d\n", error);
+		latency = 0;
+	}
+
+	bucket = min(fls64(latency), LATENCY_BUCKETS - 1);
+	histogram->buckets[bucket]++;
+
+	if (histogram->count == 0 || latency < histogram->min)
+	{
+		histogram->min = latency;
+	}
+
+	if (latency > histogram->max)
+	{
+		histogram->max = latency;
+	}
+
+	histogram->count++;
+	histogram->total += latency;
+}
+
+// Must be called with adc_lock held, returns false if the event had to be dropped
+static bool trigger_push (struct AdcTriggerEvent* event)
+{
+	event->sequence = trigger_sequence++;
+	trigger_stats.serviced++;
+	latency_record(&trigger_latency, event->complete_timestamp - event->trigger_timestamp);
+
+	if (trigger_count == ADC_TRIGGER_EVENTS)
+	{
+		trigger_stats.lost++;
+		return false;
+	}
+
+	trigger_events[(trigger_first + trigger_count) % ADC_TRIGGER_EVENTS] = *event;
+	trigger_count++;
+	return true;
+}
+
+// Adds a latched conversion of a trigger to trigger_collected, must be called with adc_lock held
+static bool trigger_collect (struct Conversion* conversion)
+{
+	bool pushed;
+
+	// a new trigger, or the rest of the previous one was lost on the way
+	if (trigger_collected.channels == 0 || trigger_collected.trigger_timestamp != conversion->trigger_timestamp)
+	{
+		memset(&trigger_collected, 0, sizeof(struct AdcTriggerEvent));
+		trigger_collected.trigger_timestamp = conversion->trigger_timestamp;
+	}
+
+	trigger_collected.channels |= 1 << conversion->channel;
+	trigger_collected.values[conversion->channel] = conversion->value;
+
+	if ((conversion->flags & CONVERSION_TRIGGER_DONE) == 0)
+	{
+		return false;
+	}
+
+	trigger_collected.complete_timestamp = ktime_to_ns(conversion->timestamp);
+	pushed = trigger_push(&trigger_collected);
+	trigger_collected.channels = 0;
+
+	return pushed;
+}
+
+// Returns the state the value moves the comparator to, crossing back inside needs the hysteresis
+static int window_state (struct WindowComparator* window, int value)
+{
+	if (value < window->low)
+	{
+		return ADC_WINDOW_BELOW;
+	}
+
+	if (value > window->high)
+	{
+		return ADC_WINDOW_ABOVE;
+	}
+
+	if (window->state == ADC_WINDOW_BELOW && value < window->low + window->hysteresis)
+	{
+		return ADC_WINDOW_BELOW;
+	}
+
+	if (window->state == ADC_WINDOW_ABOVE && value > window->high - window->hysteresis)
+	{
+		return ADC_WINDOW_ABOVE;
+	}
+
+	return ADC_WINDOW_INSIDE;
+}
+
+// Queues an event if the conversion crossed the window, must be called with adc_lock held
+static bool window_update (struct Conversion* conversion)
+{
+	struct WindowComparator* window = &channels[conversion->channel].window;
+	struct AdcWindowEvent* event;
+	int state;
+
+	if (!window->enabled)
+	{
+		return false;
+	}
+
+	state = window_state(window, conversion->value);
+	if (state == window->state)
+	{
+		return false;
+	}
+
+	window->state = state;
+
+	if (window->count == ADC_WINDOW_EVENTS)
+	{
+		window->sequence++;
+		return false;
+	}
+
+	event = &window->events[(window->first + window->count) % ADC_WINDOW_EVENTS];
+	event->timestamp = ktime_to_ns(conversion->timestamp);
+	event->sequence = window->sequence++;
+	event->value = conversion->value;
+	event->channel = conversion->channel;
+	event->state = state;
+	window->count++;
+
+	return true;
+}
+
+// Adds a streamed sample to the capture history, true once it completed a capture, must be called with adc_lock held
+static bool capture_update (struct ChannelData* data, struct Conversion* conversion)
+{
+	struct CaptureWindow* capture = &data->capture;
+	struct AdcSample* sample;
+	unsigned int first;
+	unsigned int i;
+
+	if (capture->users == 0)
+	{
+		return false;
+	}
+
+	sample = &capture->history[capture->head & ADC_CAPTURE_MASK];
+	sample->timestamp = ktime_to_ns(conversion->timestamp);
+	sample->sequence = data->sequence - 1;
+	sample->channel = conversion->channel;
+	sample->value = conversion->value;
+	capture->head++;
+
+	if (capture->filled < ADC_CAPTURE_SAMPLES)
+	{
+		capture->filled++;
+	}
+
+	// samples still queued from before the trigger belong to the pre-trigger part
+	if (!capture->triggered || sample->timestamp < capture->block.trigger_timestamp)
+	{
+		return false;
+	}
+
+	if (capture->collected++ == 0)
+	{
+		capture->trigger_head = capture->head - 1;
+	}
+
+	if (capture->collected < capture->block.post)
+	{
+		return false;
+	}
+
+	capture->block.pre = min_t(unsigned int, capture->block.pre, capture->filled - capture->collected);
+
+	first = capture->trigger_head - capture->block.pre;
+	for (i = 0; i < capture->block.pre + capture->block.post; ++i)
+	{
+		capture->block.samples[i] = capture->history[(first + i) & ADC_CAPTURE_MASK];
+	}
+
+	capture->triggered = false;
+	capture->ready = true;
+
+	return true;
+}
+
+// Arms the capture of a channel on an EINT0 trigger, must be called with adc_lock held
+static void capture_trigger (struct CaptureWindow* capture, ktime_t timestamp)
+{
+	if (capture->users == 0)
+	{
+		return;
+	}
+
+	capture->triggers++;
+
+	if (capture->triggered || capture->ready)
+	{
+		return;
+	}
+
+	capture->triggered = true;
+	capture->collected = 0;
+	capture->block.trigger_timestamp = ktime_to_ns(timestamp);
+	capture->block.sequence = capture->triggers - 1;
+	capture->block.pre = capture->pre;
+	capture->block.post = capture->post;
+}
+
+/*
+ * Hands the conversions latched by adc_interrupt to their consumers: fills the sample
+ * rings, keeps the statistics, collects the trigger events and finally wakes up the
+ * readers. adc_lock is only held for one conversion at a time.
+ */
+static void completion_run (unsigned long unused)
+{
+	struct Conversion conversion;
+	unsigned int woken = 0;
+	unsigned int crossed = 0;
+	unsigned int captured = 0;
+	bool trigger_done = false;
+	int i;
+
+	for (;;)
+	{
+		spin_lock_irq(&adc_lock);
+
+		// taken together with the empty queue, later conversions schedule the tasklet again
+		if (conversions_count == 0)
+		{
+			woken = wake_pending;
+			wake_pending = 0;
+			spin_unlock_irq(&adc_lock);
+			break;
+		}
+
+		conversion = conversions[conversions_first];
+		conversions_first = (conversions_first + 1) % ADC_CONVERSIONS;
+		conversions_count--;
+
+		if ((conversion.flags & CONVERSION_TIMEOUT) == 0)
+		{
+			statistics_update(&channels[conversion.channel].statistics, conversion.value);
+		}
+
+		if ((conversion.flags & CONVERSION_STREAM) != 0 && channels[conversion.channel].stream_users > 0)
+		{
+			ring_push(conversion.channel, conversion.value, conversion.timestamp);
+
+			if (channels[conversion.channel].period_ns != 0)
+			{
+				rate_update(&channels[conversion.channel], ktime_to_ns(conversion.timestamp));
+			}
+
+			if (window_update(&conversion))
+			{
+				crossed |= 1 << conversion.channel;
+			}
+
+			if (capture_update(&channels[conversion.channel], &conversion))
+			{
+				captured |= 1 << conversion.channel;
+			}
+		}
+
+		if ((conversion.flags & CONVERSION_TRIGGER) != 0 && trigger_collect(&conversion))
+		{
+			trigger_done = true;
+		}
+
+		spin_unlock_irq(&adc_lock);
+
+		if ((conversion.flags & CONVERSION_TIMEOUT) == 0)
+		{
+			trace_adc_conversion(conversion.channel, conversion.value, ktime_to_ns(conversion.timestamp));
+		}
+	}
+
+	for (i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		if ((woken & (1 << i)) != 0)
+		{
+			wake_up_interruptible(&channels[i].wait);
+			kill_fasync(&channels[i].async_queue, SIGIO, POLL_IN);
+		}
+
+		if ((crossed & (1 << i)) != 0)
+		{
+			wake_up_interruptible(&channels[i].window.wait);
+			kill_fasync(&channels[i].window.async_queue, SIGIO, POLL_IN);
+		}
+
+		if ((captured & (1 << i)) != 0)
+		{
+			wake_up_interruptible(&channels[i].capture.wait);
+			kill_fasync(&channels[i].capture.async_queue, SIGIO, POLL_IN);
+		}
+	}
+
+	if ((woken & WAKE_SCAN) != 0)
+	{
+		wake_up_interruptible(&scan_wait);
+	}
+
+	if (trigger_done)
+	{
+		wake_up_interruptible(&trigger_wait);
+		kill_fasync(&trigger_async_queue, SIGIO, POLL_IN);
+	}
+
+	if ((woken & WAKE_BATCH) != 0)
+	{
+		wake_up_interruptible(&batch_wait);
+	}
+}
+
+// Hands a result to the text readers, must be called with adc_lock held
+static void result_latch (struct ChannelData* data, int value, unsigned int extra_bits, ktime_t timestamp)
+{
+	adc_values[data->number] = value;
+	data->extra_bits = extra_bits;
+	data->completed++;
+
+	write_seqlock(&data->cache_lock);
+	data->cache_value = value;
+	data->cache_time = ktime_to_ns(timestamp);
+	write_sequnlock(&data->cache_lock);
+}
+
+// Queues a conversion for completion_tasklet, must be called with adc_lock held
+static void conversion_push (struct Conversion* conversion)
+{
+	struct ChannelData* data = &channels[conversion->channel];
+
+	wake_pending |= 1 << conversion->channel;
+
+	if ((conversion->flags & CONVERSION_SCAN_DONE) != 0)
+	{
+		wake_pending |= WAKE_SCAN;
+	}
+
+	if ((conversion->flags & CONVERSION_BATCH_DONE) != 0)
+	{
+		wake_pending |= WAKE_BATCH;
+	}
+
+	if (conversions_count < ADC_CONVERSIONS)
+	{
+		conversions[(conversions_first + conversions_count) % ADC_CONVERSIONS] = *conversion;
+		conversions_count++;
+		return;
+	}
+
+	conversions_lost++;
+
+	// leave a gap in the sample sequence, a trigger event without its last channel is lost
+	if ((conversion->flags & CONVERSION_STREAM) != 0 && data->stream_users > 0)
+	{
+		data->sequence++;
+	}
+
+	if ((conversion->flags & CONVERSION_TRIGGER_DONE) != 0)
+	{
+		trigger_stats.lost++;
+	}
+}
+
+/*
+ * Runs with interrupts disabled, so it only latches the value, advances the state of the
+ * request that is running and starts the next conversion. The completion counters and
+ * scan_result are updated here already so a reader never issues a request against a
+ * stale generation, completion_tasklet does the rest.
+ */
+static irqreturn_t adc_interrupt (int irq, void * dev_id)
+{
+	ktime_t timestamp = ktime_get();
+	struct Conversion conversion;
+	struct ChannelData* data;
+
+	conversion.timestamp = timestamp;
+	conversion.trigger_timestamp = 0;
+	conversion.flags = 0;
+	conversion.value = ioread32(ADC_VALUE) & ADC_VALUE_MASK;
+
+	spin_lock(&adc_lock);
+
+	// the conversion already timed out, the converter was reset since
+	if (!adc_busy)
+	{
+		spin_unlock(&adc_lock);
+		return (IRQ_HANDLED);
+	}
+
+	hrtimer_try_to_cancel(&conversion_watchdog);
+	adc_busy = false;
+	conversion.channel = adc_channel;
+	data = &channels[adc_channel];
+	latency_record(&conversion_time, ktime_to_ns(ktime_sub(timestamp, adc_start_time)));
+
+	if (resume_pending)
+	{
+		latency_record(&resume_latency, ktime_to_ns(ktime_sub(timestamp, resume_time)));
+		resume_pending = false;
+	}
+
+	/*
+	 * With oversampling only the decimated result of a single conversion request is handed
+	 * to the text readers, the raw conversions of the other requests would have the wrong scale.
+	 */
+	if (oneshot_in_flight)
+	{
+		oneshot_sum += conversion.value;
+
+		if (--oneshot_left == 0)
+		{
+			oneshot_in_flight = false;
+			result_latch(data, oneshot_sum >> oneshot_shift, oneshot_bits, timestamp);
+		}
+	}
+	else if (data->oversampling == 1)
+	{
+		result_latch(data, conversion.value, 0, timestamp);
+	}
+
+	if (stream_in_flight)
+	{
+		stream_in_flight = false;
+		conversion.flags |= CONVERSION_STREAM;
+	}
+
+	if (scan_in_flight)
+	{
+		scan_progress.values[adc_channel] = conversion.value;
+
+		if (adc_channel == ADC_NUMCHANNELS - 1)
+		{
+			scan_in_flight = false;
+			scan_progress.timestamp = ktime_to_ns(timestamp);
+			scan_result = scan_progress;
+			scan_completed++;
+			conversion.flags |= CONVERSION_SCAN_DONE;
+		}
+	}
+	else if (trigger_in_flight)
+	{
+		conversion.flags |= CONVERSION_TRIGGER;
+		conversion.trigger_timestamp = trigger_progress.trigger_timestamp;
+
+		if (next_channel(trigger_progress.channels, adc_channel) < 0)
+		{
+			trigger_in_flight = false;
+			conversion.flags |= CONVERSION_TRIGGER_DONE;
+
+			// the triggers that came in meanwhile go to the back of the request queue
+			if (trigger_times_count > 0)
+			{
+				request_enqueue(ADC_REQUEST_TRIGGER);
+			}
+		}
+	}
+	else if (batch_in_flight)
+	{
+		batch_values[batch_index++] = conversion.value;
+
+		if (batch_index == batch_length)
+		{
+			batch_in_flight = false;
+			batch_timestamp = ktime_to_ns(timestamp);
+			batch_completed++;
+			conversion.flags |= CONVERSION_BATCH_DONE;
+		}
+	}
+
+	adc_next_conversion();
+	conversion_push(&conversion);
+
+	latency_record(&irq_time, ktime_to_ns(ktime_sub(ktime_get(), timestamp)));
+
+	spin_unlock(&adc_lock);
+
+	tasklet_schedule(&completion_tasklet);
+
+    return (IRQ_HANDLED);
+}
+
+static irqreturn_t gp_interrupt(int irq, void * dev_id)
+{
+	ktime_t timestamp = ktime_get();
+	int i;
+
+	spin_lock(&adc_lock);
+
+	for (i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		capture_trigger(&channels[i].capture, timestamp);
+	}
+
+	trigger_stats.received++;
+
+	if (trigger_times_count >= clamp_t(unsigned int, trigger_depth, 1, ADC_TRIGGER_DEPTH_MAX))
+	{
+		trigger_stats.dropped++;
+		trace_adc_trigger(ktime_to_ns(timestamp), trigger_times_count, true);
+	}
+	else
+	{
+		trigger_times[(trigger_times_first + trigger_times_count) % ADC_TRIGGER_DEPTH_MAX] = timestamp;
+		trigger_times_count++;
+		trace_adc_trigger(ktime_to_ns(timestamp), trigger_times_count, false);
+
+		request_enqueue(ADC_REQUEST_TRIGGER);
+		adc_next_conversion();
+	}
+
+	spin_unlock(&adc_lock);
+
+    return (IRQ_HANDLED);
+}
+
+/*
+ * Fires when a conversion got no interrupt within conversion_timeout_ms. The converter is
+ * reset and the request it belonged to is failed, its readers see -ETIMEDOUT, the queue
+ * goes on with the next request.
+ */
+static enum hrtimer_restart conversion_watchdog_run (struct hrtimer * timer)
+{
+	struct Conversion conversion;
+	struct ChannelData* data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&adc_lock, flags);
+
+	// adc_interrupt could not cancel the timer any more, or a newer conversion rearmed it
+	if (!adc_busy || ktime_to_ns(ktime_sub(ktime_get(), adc_start_time)) < (s64)conversion_timeout_ms * NSEC_PER_MSEC)
+	{
+		spin_unlock_irqrestore(&adc_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	adc_reset();
+	adc_busy = false;
+	conversion_timeouts++;
+	trace_adc_timeout(adc_channel);
+
+	memset(&conversion, 0, sizeof(struct Conversion));
+	conversion.timestamp = ktime_get();
+	conversion.channel = adc_channel;
+	conversion.flags = CONVERSION_TIMEOUT;
+	data = &channels[adc_channel];
+
+	stream_in_flight = false;
+
+	if (oneshot_in_flight)
+	{
+		oneshot_in_flight = false;
+		data->completed++;
+		data->failed = data->completed;
+	}
+
+	if (scan_in_flight)
+	{
+		scan_in_flight = false;
+		scan_completed++;
+		scan_failed = scan_completed;
+		conversion.flags |= CONVERSION_SCAN_DONE;
+	}
+	else if (trigger_in_flight)
+	{
+		// the channels converted so far are dropped by trigger_collect with the next trigger
+		trigger_in_flight = false;
+		trigger_stats.timed_out++;
+
+		if (trigger_times_count > 0)
+		{
+			request_enqueue(ADC_REQUEST_TRIGGER);
+		}
+	}
+	else if (batch_in_flight)
+	{
+		batch_in_flight = false;
+		batch_completed++;
+		batch_failed = batch_completed;
+		conversion.flags |= CONVERSION_BATCH_DONE;
+	}
+
+	adc_next_conversion();
+	conversion_push(&conversion);
+
+	spin_unlock_irqrestore(&adc_lock, flags);
+
+	tasklet_schedule(&completion_tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+static void adc_exit (void)
+{
+    printk(KERN_DEBUG DEVICE_NAME ": adc_exit\n");
+    free_irq (IRQ_LPC32XX_TS_IRQ, NULL);
+    free_irq (IRQ_LPC32XX_GPI_01, NULL);
+    hrtimer_cancel(&conversion_watchdog);
+    tasklet_kill(&completion_tasklet);
+
+	spin_lock_irq(&adc_lock);
+	autosuspend_armed = false;
+	spin_unlock_irq(&adc_lock);
+	cancel_delayed_work_sync(&autosuspend_work);
+}
+
+
+static enum hrtimer_restart sample_timer (struct hrtimer * timer)
+{
+	struct ChannelData* data = container_of(timer, struct ChannelData, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&adc_lock, flags);
+
+	if (request_queued[ADC_REQUEST_TIMED + data->number])
+	{
+		data->rate.missed++;
+	}
+	else
+	{
+		request_enqueue(ADC_REQUEST_TIMED + data->number);
+		adc_next_conversion();
+	}
+
+	spin_unlock_irqrestore(&adc_lock, flags);
+
+	hrtimer_forward_now(timer, ns_to_ktime(data->period_ns));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Runs the sampling timer of a channel while it has a period and stream users,
+ * restarting it from scratch with fresh statistics whenever the period changes.
+ * Must be called with timer_lock held, never with adc_lock since the timer takes it.
+ */
+static void sample_timer_update (struct ChannelData* data)
+{
+	bool run = data->period_ns != 0 && ACCESS_ONCE(data->stream_users) > 0;
+
+	if (data->timer_running)
+	{
+		hrtimer_cancel(&data->timer);
+		data->timer_running = false;
+	}
+
+	if (run)
+	{
+		spin_lock_irq(&adc_lock);
+		memset(&data->rate, 0, sizeof(struct RateStatistics));
+		spin_unlock_irq(&adc_lock);
+
+		hrtimer_start(&data->timer, ns_to_ktime(data->period_ns), HRTIMER_MODE_REL);
+		data->timer_running = true;
+	}
+}
+
+static void stream_start (int channel)
+{
+	struct ChannelData* data = &channels[channel];
+	bool first;
+
+	mutex_lock(&data->timer_lock);
+
+	spin_lock_irq(&adc_lock);
+
+	first = data->stream_users++ == 0;
+	if (first)
+	{
+		// drop whatever was left over from a previous streaming session
+		data->header->tail = data->head;
+	}
+
+	adc_next_conversion();
+
+	spin_unlock_irq(&adc_lock);
+
+	if (first)
+	{
+		sample_timer_update(data);
+	}
+
+	mutex_unlock(&data->timer_lock);
+}
+
+static void stream_stop (int channel)
+{
+	struct ChannelData* data = &channels[channel];
+	bool last;
+
+	mutex_lock(&data->timer_lock);
+
+	spin_lock_irq(&adc_lock);
+	last = --data->stream_users == 0;
+	spin_unlock_irq(&adc_lock);
+
+	if (last)
+	{
+		sample_timer_update(data);
+	}
+
+	mutex_unlock(&data->timer_lock);
+}
+
+static ssize_t stream_read (struct ChannelData* channel, bool nonblock, char __user * buffer, size_t len)
+{
+	unsigned int tail;
+	unsigned int available;
+	unsigned int count;
+	unsigned int first;
+	unsigned int chunk;
+
+	count = len / sizeof(struct AdcSample);
+	if (count == 0)
+	{
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&channel->read_lock) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	if (nonblock && ring_available(channel) == 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -EAGAIN;
+	}
+
+	if (wait_event_interruptible(channel->wait, ring_available(channel) != 0) != 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -ERESTARTSYS;
+	}
+
+	tail = ACCESS_ONCE(channel->header->tail);
+	available = ACCESS_ONCE(channel->head) - tail;
+
+	// the mapping changed tail since ring_available checked it
+	if (available > ADC_RING_SIZE)
+	{
+		channel->header->tail = ACCESS_ONCE(channel->head);
+		mutex_unlock(&channel->read_lock);
+		return -EIO;
+	}
+
+	count = min(count, available);
+	smp_rmb();
+
+	// the records may wrap around the end of the ring, so copy in at most two parts
+	first = tail & ADC_RING_MASK;
+	chunk = min(count, ADC_RING_SIZE - first);
+
+	if (copy_to_user(buffer, &channel->samples[first], chunk * sizeof(struct AdcSample)) != 0 ||
+		copy_to_user(buffer + chunk * sizeof(struct AdcSample), &channel->samples[0], (count - chunk) * sizeof(struct AdcSample)) != 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -EFAULT;
+	}
+
+	// the slots may only be reused by adc_interrupt once they have been copied
+	smp_mb();
+	channel->header->tail = tail + count;
+
+	mutex_unlock(&channel->read_lock);
+
+	return count * sizeof(struct AdcSample);
+}
+
+static bool trigger_pop (struct AdcTriggerEvent* event)
+{
+	bool found = false;
+
+	spin_lock_irq(&adc_lock);
+
+	if (trigger_count > 0)
+	{
+		*event = trigger_events[trigger_first];
+		trigger_first = (trigger_first + 1) % ADC_TRIGGER_EVENTS;
+		trigger_count--;
+		found = true;
+	}
+
+	spin_unlock_irq(&adc_lock);
+
+	return found;
+}
+
+static ssize_t trigger_read (bool nonblock, char __user * buffer, size_t len)
+{
+	struct AdcTriggerEvent event;
+	size_t written = 0;
+
+	if (len < sizeof(struct AdcTriggerEvent))
+	{
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&trigger_read_lock) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	if (nonblock && ACCESS_ONCE(trigger_count) == 0)
+	{
+		mutex_unlock(&trigger_read_lock);
+		return -EAGAIN;
+	}
+
+	if (wait_event_interruptible(trigger_wait, ACCESS_ONCE(trigger_count) != 0) != 0)
+	{
+		mutex_unlock(&trigger_read_lock);
+		return -ERESTARTSYS;
+	}
+
+	while (written + sizeof(struct AdcTriggerEvent) <= len && trigger_pop(&event))
+	{
+		if (copy_to_user(buffer + written, &event, sizeof(struct AdcTriggerEvent)) != 0)
+		{
+			mutex_unlock(&trigger_read_lock);
+			return -EFAULT;
+		}
+
+		written += sizeof(struct AdcTriggerEvent);
+	}
+
+	mutex_unlock(&trigger_read_lock);
+
+	return written;
+}
+
+static bool window_pop (struct WindowComparator* window, struct AdcWindowEvent* event)
+{
+	bool found = false;
+
+	spin_lock_irq(&adc_lock);
+
+	if (window->count > 0)
+	{
+		*event = window->events[window->first];
+		window->first = (window->first + 1) % ADC_WINDOW_EVENTS;
+		window->count--;
+		found = true;
+	}
+
+	spin_unlock_irq(&adc_lock);
+
+	return found;
+}
+
+static ssize_t window_read (struct ChannelData* channel, bool nonblock, char __user * buffer, size_t len)
+{
+	struct WindowComparator* window = &channel->window;
+	struct AdcWindowEvent event;
+	size_t written = 0;
+
+	if (len < sizeof(struct AdcWindowEvent))
+	{
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&channel->read_lock) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	if (nonblock && ACCESS_ONCE(window->count) == 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -EAGAIN;
+	}
+
+	if (wait_event_interruptible(window->wait, ACCESS_ONCE(window->count) != 0) != 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -ERESTARTSYS;
+	}
+
+	while (written + sizeof(struct AdcWindowEvent) <= len && window_pop(window, &event))
+	{
+		if (copy_to_user(buffer + written, &event, sizeof(struct AdcWindowEvent)) != 0)
+		{
+			mutex_unlock(&channel->read_lock);
+			return -EFAULT;
+		}
+
+		written += sizeof(struct AdcWindowEvent);
+	}
+
+	mutex_unlock(&channel->read_lock);
+
+	return written;
+}
+
+static ssize_t capture_read (struct ChannelData* channel, bool nonblock, char __user * buffer, size_t len)
+{
+	struct CaptureWindow* capture = &channel->capture;
+
+	if (len < sizeof(struct AdcCapture))
+	{
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&channel->read_lock) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	if (nonblock && !ACCESS_ONCE(capture->ready))
+	{
+		mutex_unlock(&channel->read_lock);
+		return -EAGAIN;
+	}
+
+	if (wait_event_interruptible(capture->wait, ACCESS_ONCE(capture->ready)) != 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -ERESTARTSYS;
+	}
+
+	// nothing touches the block while it is ready
+	if (copy_to_user(buffer, &capture->block, sizeof(struct AdcCapture)) != 0)
+	{
+		mutex_unlock(&channel->read_lock);
+		return -EFAULT;
+	}
+
+	spin_lock_irq(&adc_lock);
+	capture->ready = false;
+	spin_unlock_irq(&adc_lock);
+
+	mutex_unlock(&channel->read_lock);
+
+	return sizeof(struct AdcCapture);
+}
+
+// A channel in capture mode keeps its history from the first user on and forgets it with the last
+static void capture_users (struct ChannelData* channel, int change)
+{
+	struct CaptureWindow* capture = &channel->capture;
+
+	spin_lock_irq(&adc_lock);
+
+	capture->users += change;
+	if (capture->users == 0)
+	{
+		capture->filled = 0;
+		capture->triggered = false;
+		capture->ready = false;
+	}
+
+	spin_unlock_irq(&adc_lock);
+}
+
+static wait_queue_head_t* completion_queue (struct MessageData* data)
+{
+	return data->mode == ADC_MODE_SCAN ? &scan_wait : &channels[data->channel].wait;
+}
+
+static unsigned int completion_count (struct MessageData* data)
+{
+	return data->mode == ADC_MODE_SCAN ? ACCESS_ONCE(scan_completed) : ACCESS_ONCE(channels[data->channel].completed);
+}
+
+// True if the conversion the descriptor needs is already requested or running, must be called with adc_lock held
+static bool conversion_in_progress (struct MessageData* data)
+{
+	if (data->mode == ADC_MODE_SCAN)
+	{
+		return request_queued[ADC_REQUEST_SCAN] || scan_in_flight;
+	}
+
+	return request_queued[data->channel] || (oneshot_in_flight && adc_channel == data->channel);
+}
+
+/*
+ * Makes sure a conversion for the descriptor is on its way and remembers the completion
+ * count it has to wait for. A matching conversion that is already queued or running is
+ * shared, otherwise a new request is queued and started as soon as the converter is idle.
+ */
+static void request_conversion (struct MessageData* data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&adc_lock, flags);
+
+	data->generation = completion_count(data);
+	data->pending = true;
+
+	if (!conversion_in_progress(data))
+	{
+		request_enqueue(data->mode == ADC_MODE_SCAN ? ADC_REQUEST_SCAN : data->channel);
+		adc_next_conversion();
+	}
+
+	spin_unlock_irqrestore(&adc_lock, flags);
+}
+
+static bool conversion_done (struct MessageData* data)
+{
+	return completion_count(data) != data->generation;
+}
+
+// True if the first completion after the request of the descriptor was a timeout
+static bool conversion_failed (struct MessageData* data)
+{
+	unsigned int failed = data->mode == ADC_MODE_SCAN ? ACCESS_ONCE(scan_failed) : ACCESS_ONCE(channels[data->channel].failed);
+
+	return failed == data->generation + 1;
+}
+
+/*
+ * Waits for the conversion of the descriptor, issuing it first if needed. When interrupted
+ * the request stays pending and the next read picks up its result.
+ */
+static int wait_for_conversion (struct MessageData* data, bool nonblock)
+{
+	if (!data->pending)
+	{
+		request_conversion(data);
+	}
+
+	if (!conversion_done(data))
+	{
+		if (nonblock)
+		{
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(*completion_queue(data), conversion_done(data)) != 0)
+		{
+			return -ERESTARTSYS;
+		}
+	}
+
+	data->pending = false;
+	return conversion_failed(data) ? -ETIMEDOUT : SUCCESS;
+}
+
+static ssize_t scan_read (struct MessageData* data, bool nonblock, char __user * buffer, size_t len)
+{
+	struct AdcScan scan;
+	int error;
+
+	if (len < sizeof(struct AdcScan))
+	{
+		return -EINVAL;
+	}
+
+	error = wait_for_conversion(data, nonblock);
+	if (error != SUCCESS)
+	{
+		return error;
+	}
+
+	spin_lock_irq(&adc_lock);
+	scan = scan_result;
+	spin_unlock_irq(&adc_lock);
+
+	if (copy_to_user(buffer, &scan, sizeof(struct AdcScan)) != 0)
+	{
+		return -EFAULT;
+	}
+
+	return sizeof(struct AdcScan);
+}
+
+// Repeat and cached mode return a whole value per read(), so the file position and data->buffer are not used
+static ssize_t value_copy (int value, char __user * buffer, size_t len)
+{
+	char text[16];
+	int length = snprintf(text, sizeof(text), "%d\n", value);
+
+	if (len < (size_t)length)
+	{
+		return -EINVAL;
+	}
+
+	if (copy_to_user(buffer, text, length) != 0)
+	{
+		return -EFAULT;
+	}
+
+	return length;
+}
+
+static ssize_t repeat_read (struct MessageData* data, bool nonblock, char __user * buffer, size_t len)
+{
+	int error = wait_for_conversion(data, nonblock);
+
+	if (error != SUCCESS)
+	{
+		return error;
+	}
+
+	return value_copy(adc_values[data->channel], buffer, len);
+}
+
+// Looks up the millivolts of a result, oversampled results are interpolated between two codes
+static int calibrate (struct ChannelData* data, int value, unsigned int extra_bits)
+{
+	int code = value >> extra_bits;
+	int fraction = value & ((1 << extra_bits) - 1);
+	int low;
+	int high;
+
+	if (code >= ADC_CODES - 1)
+	{
+		return data->calibration[ADC_CODES - 1];
+	}
+
+	low = data->calibration[code];
+	high = data->calibration[code + 1];
+
+	return low + (high - low) * fraction / (1 << extra_bits);
+}
+
+static ssize_t millivolt_read (struct MessageData* data, bool nonblock, char __user * buffer, size_t len)
+{
+	struct ChannelData* channel = &channels[data->channel];
+	int millivolts;
+	int error = wait_for_conversion(data, nonblock);
+
+	if (error != SUCCESS)
+	{
+		return error;
+	}
+
+	// the table and the result may both be replaced meanwhile
+	spin_lock_irq(&adc_lock);
+	millivolts = calibrate(channel, adc_values[data->channel], channel->extra_bits);
+	spin_unlock_irq(&adc_lock);
+
+	return value_copy(millivolts, buffer, len);
+}
+
+// Reads the last result without taking any lock, true if it is at most max_age_ns old
+static bool cache_fresh (struct ChannelData* channel, int* value)
+{
+	unsigned int sequence;
+	s64 time;
+	u64 max_age;
+
+	do
+	{
+		sequence = read_seqbegin(&channel->cache_lock);
+		*value = channel->cache_value;
+		time = channel->cache_time;
+		max_age = channel->max_age_ns;
+	}
+	while (read_seqretry(&channel->cache_lock, sequence));
+
+	return time != 0 && ktime_to_ns(ktime_get()) - time <= (s64)max_age;
+}
+
+static ssize_t cached_read (struct MessageData* data, bool nonblock, char __user * buffer, size_t len)
+{
+	int value;
+
+	if (cache_fresh(&channels[data->channel], &value))
+	{
+		// a conversion issued earlier by poll() is older than this value already
+		data->pending = false;
+		return value_copy(value, buffer, len);
+	}
+
+	return repeat_read(data, nonblock, buffer, len);
+}
+
+static ssize_t dev_read (struct file * file, char __user * buffer, size_t len, loff_t * offset)
+{
+    int current_offset;
+	int dataLength;
+	int bytesLeft;
+	int written;
+	int value;
+	int error;
+
+	struct MessageData* data = file->private_data;
+	bool nonblock = (file->f_flags & O_NONBLOCK) != 0;
+
+    if (data->channel < 0 || data->channel >= ADC_NUMCHANNELS)
+    {
+        return -EFAULT;
+    }
+
+	if (data->mode == ADC_MODE_STREAM)
+	{
+		return stream_read(&channels[data->channel], nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_SCAN)
+	{
+		return scan_read(data, nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_TRIGGER)
+	{
+		return trigger_read(nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_REPEAT)
+	{
+		return repeat_read(data, nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_CACHED)
+	{
+		return cached_read(data, nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_WINDOW)
+	{
+		return window_read(&channels[data->channel], nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_MILLIVOLT)
+	{
+		return millivolt_read(data, nonblock, buffer, len);
+	}
+
+	if (data->mode == ADC_MODE_CAPTURE)
+	{
+		return capture_read(&channels[data->channel], nonblock, buffer, len);
+	}
+
+    if (*offset == 0)
+    {
+        printk (KERN_DEBUG DEVICE_NAME ": device_read(%d)\n", data->channel);
+
+		error = wait_for_conversion(data, nonblock);
+		if (error != SUCCESS)
+		{
+			return error;
+		}
+
+		value = adc_values[data->channel];
+
+        data->length = snprintf(data->buffer, MAX_BUFFER, "%d", value) + NULL_BYTE_ENDING;
+    }
+
+    current_offset = *offset;
+	dataLength = data->length- current_offset;
+
+	bytesLeft = copy_to_user(buffer, data->buffer + current_offset, dataLength);
+	written = dataLength - bytesLeft;
+	*offset = current_offset + written;
+
+	return written;
+}
+
+static bool batch_busy (void)
+{
+	return ACCESS_ONCE(batch_in_flight) || ACCESS_ONCE(request_queued[ADC_REQUEST_BATCH]);
+}
+
+/*
+ * Runs a validated batch, leaving the results in batch_values, must be called with batch_lock
+ * held. A batch whose caller was interrupted keeps running on batch_values, so the next one
+ * waits for it first.
+ */
+static long batch_execute (const u8* list, unsigned int count, unsigned int repeat)
+{
+	unsigned int generation;
+
+	if (wait_event_interruptible(batch_wait, !batch_busy()) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	spin_lock_irq(&adc_lock);
+
+	memcpy(batch_channels, list, count);
+	batch_count = count;
+	batch_length = count * repeat;
+	generation = batch_completed;
+
+	request_enqueue(ADC_REQUEST_BATCH);
+	adc_next_conversion();
+
+	spin_unlock_irq(&adc_lock);
+
+	if (wait_event_interruptible(batch_wait, ACCESS_ONCE(batch_completed) != generation) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	return ACCESS_ONCE(batch_failed) == generation + 1 ? -ETIMEDOUT : SUCCESS;
+}
+
+// Must be called with batch_lock held
+static long batch_run (struct AdcBatch* batch, struct AdcBatch __user * argument)
+{
+	unsigned int length = batch->count * batch->repeat;
+	long error = batch_execute(batch->channels, batch->count, batch->repeat);
+
+	if (error != SUCCESS)
+	{
+		return error;
+	}
+
+	if (copy_to_user((void __user *)(unsigned long)batch->values, batch_values, length * sizeof(u16)) != 0)
+	{
+		return -EFAULT;
+	}
+
+	return put_user(batch_timestamp, &argument->timestamp);
+}
+
+static long batch_convert (struct AdcBatch __user * argument)
+{
+	struct AdcBatch batch;
+	unsigned int i;
+	long error;
+
+	if (copy_from_user(&batch, argument, sizeof(struct AdcBatch)) != 0)
+	{
+		return -EFAULT;
+	}
+
+	if (batch.count == 0 || batch.count > ADC_BATCH_CHANNELS || batch.repeat == 0 || batch.repeat > ADC_BATCH_MAX / batch.count)
+	{
+		return -EINVAL;
+	}
+
+	for (i = 0; i < batch.count; ++i)
+	{
+		if (batch.channels[i] >= ADC_NUMCHANNELS)
+		{
+			return -EINVAL;
+		}
+	}
+
+	if (mutex_lock_interruptible(&batch_lock) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	error = batch_run(&batch, argument);
+
+	mutex_unlock(&batch_lock);
+	return error;
+}
+
+// The fasync list SIGIO comes from, descriptors in a mode with events are only signalled for these
+static struct fasync_struct** fasync_queue (struct MessageData* data)
+{
+	if (data->mode == ADC_MODE_WINDOW)
+	{
+		return &channels[data->channel].window.async_queue;
+	}
+
+	if (data->mode == ADC_MODE_TRIGGER)
+	{
+		return &trigger_async_queue;
+	}
+
+	if (data->mode == ADC_MODE_CAPTURE)
+	{
+		return &channels[data->channel].capture.async_queue;
+	}
+
+	return &channels[data->channel].async_queue;
+}
+
+static int set_read_mode (struct file * file, int mode)
+{
+	struct MessageData* data = file->private_data;
+
+	if (mode < 0 || mode >= ADC_MODE_MAX)
+	{
+		return -EINVAL;
+	}
+
+	if (mode == data->mode)
+	{
+		return SUCCESS;
+	}
+
+	if (data->async_fd >= 0)
+	{
+		fasync_helper(-1, file, 0, fasync_queue(data));
+	}
+
+	if (data->mode == ADC_MODE_CAPTURE)
+	{
+		capture_users(&channels[data->channel], -1);
+	}
+
+	// the window and the capture work on the streamed samples, so these modes keep the channel sampling
+	if (data->mode == ADC_MODE_STREAM || data->mode == ADC_MODE_WINDOW || data->mode == ADC_MODE_CAPTURE)
+	{
+		stream_stop(data->channel);
+	}
+
+	if (mode == ADC_MODE_STREAM || mode == ADC_MODE_WINDOW || mode == ADC_MODE_CAPTURE)
+	{
+		stream_start(data->channel);
+	}
+
+	if (mode == ADC_MODE_CAPTURE)
+	{
+		capture_users(&channels[data->channel], 1);
+	}
+
+	data->mode = mode;
+	data->pending = false;
+
+	if (data->async_fd >= 0)
+	{
+		fasync_helper(data->async_fd, file, 1, fasync_queue(data));
+	}
+
+	return SUCCESS;
+}
+
+static long dev_ioctl (struct file * file, unsigned int command, unsigned long argument)
+{
+	struct MessageData* data = file->private_data;
+	struct AdcTriggerStats stats;
+	int value;
+
+	switch (command)
+	{
+	case ADC_IOC_SET_MODE:
+		if (get_user(value, (int __user *)argument) != 0)
+		{
+			return -EFAULT;
+		}
+		return set_read_mode(file, value);
+
+	case ADC_IOC_GET_MODE:
+		return put_user(data->mode, (int __user *)argument);
+
+	case ADC_IOC_GET_TRIGGER_STATS:
+		spin_lock_irq(&adc_lock);
+		stats = trigger_stats;
+		stats.pending = trigger_times_count + (trigger_in_flight ? 1 : 0);
+		spin_unlock_irq(&adc_lock);
+
+		return copy_to_user((void __user *)argument, &stats, sizeof(struct AdcTriggerStats)) != 0 ? -EFAULT : SUCCESS;
+
+	case ADC_IOC_BATCH:
+		return batch_convert((struct AdcBatch __user *)argument);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * In stream mode the descriptor is readable while the ring holds samples and in trigger
+ * mode while trigger events are queued. In the other modes polling issues a conversion
+ * for the descriptor if it has none outstanding yet and reports it readable once that
+ * conversion completed.
+ */
+static unsigned int dev_poll (struct file * file, poll_table * wait)
+{
+	struct MessageData* data = file->private_data;
+	struct ChannelData* channel = &channels[data->channel];
+	int value;
+
+	if (data->mode == ADC_MODE_STREAM)
+	{
+		poll_wait(file, &channel->wait, wait);
+		return ring_available(channel) != 0 ? POLLIN | POLLRDNORM : 0;
+	}
+
+	if (data->mode == ADC_MODE_TRIGGER)
+	{
+		poll_wait(file, &trigger_wait, wait);
+		return ACCESS_ONCE(trigger_count) != 0 ? POLLIN | POLLRDNORM : 0;
+	}
+
+	if (data->mode == ADC_MODE_WINDOW)
+	{
+		poll_wait(file, &channel->window.wait, wait);
+		return ACCESS_ONCE(channel->window.count) != 0 ? POLLIN | POLLRDNORM : 0;
+	}
+
+	if (data->mode == ADC_MODE_CAPTURE)
+	{
+		poll_wait(file, &channel->capture.wait, wait);
+		return ACCESS_ONCE(channel->capture.ready) ? POLLIN | POLLRDNORM : 0;
+	}
+
+	poll_wait(file, completion_queue(data), wait);
+
+	if (data->mode == ADC_MODE_CACHED && cache_fresh(channel, &value))
+	{
+		return POLLIN | POLLRDNORM;
+	}
+
+	if (!data->pending)
+	{
+		request_conversion(data);
+	}
+
+	return conversion_done(data) ? POLLIN | POLLRDNORM : 0;
+}
+
+static int dev_fasync (int fd, struct file * file, int on)
+{
+	struct MessageData* data = file->private_data;
+	int error = fasync_helper(fd, file, on, fasync_queue(data));
+
+	if (error >= 0)
+	{
+		data->async_fd = on ? fd : -1;
+	}
+
+	return error;
+}
+
+// The channel keeps streaming for as long as any process has its ring mapped
+static void ring_vm_open (struct vm_area_struct * vma)
+{
+	stream_start((long)vma->vm_private_data);
+}
+
+static void ring_vm_close (struct vm_area_struct * vma)
+{
+	stream_stop((long)vma->vm_private_data);
+}
+
+static struct vm_operations_struct ring_vm_ops =
+{
+	.open = ring_vm_open,
+	.close = ring_vm_close,
+};
+
+static int dev_mmap (struct file * file, struct vm_area_struct * vma)
+{
+	struct MessageData* data = file->private_data;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_ALIGN(ADC_RING_BYTES))
+	{
+		return -EINVAL;
+	}
+
+	if (remap_vmalloc_range(vma, channels[data->channel].ring, 0) != 0)
+	{
+		return -EAGAIN;
+	}
+
+	vma->vm_ops = &ring_vm_ops;
+	vma->vm_private_data = (void*)(long)data->channel;
+	ring_vm_open(vma);
+
+	return SUCCESS;
+}
+
+static int dev_open (struct inode * inode, struct file * file)
+{
+    struct MessageData* data;
+    int channel = iminor(file->f_dentry->d_inode);
+
+    file->private_data = kmalloc(sizeof(struct MessageData), GFP_KERNEL);
+
+    if (file == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    data = (struct MessageData*)file->private_data;
+    data->channel = channel;
+    data->mode = ADC_MODE_ASCII;
+    data->length = 0;
+    data->pending = false;
+    data->async_fd = -1;
+
+    try_module_get(THIS_MODULE);
+
+	return SUCCESS;
+}
+
+static int dev_release (struct inode* inode, struct file* fileToClose)
+{
+    if (fileToClose->private_data != NULL)
+    {
+        set_read_mode(fileToClose, ADC_MODE_ASCII);
+        dev_fasync(-1, fileToClose, 0);
+        kfree(fileToClose->private_data);
+        fileToClose->private_data = NULL;
+    }
+
+    printk (KERN_DEBUG DEVICE_NAME ": device_release()\n");
+    module_put(THIS_MODULE);
+
+	return SUCCESS;
+}
+
+static ssize_t period_ns_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+
+	return sprintf(buffer, "%llu\n", (unsigned long long)data->period_ns);
+}
+
+static ssize_t period_ns_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	unsigned long long period;
+
+	if (strict_strtoull(buffer, 10, &period) != 0 || (period != 0 && period < ADC_MIN_PERIOD_NS))
+	{
+		return -EINVAL;
+	}
+
+	mutex_lock(&data->timer_lock);
+
+	spin_lock_irq(&adc_lock);
+	data->period_ns = period;
+	adc_next_conversion();
+	spin_unlock_irq(&adc_lock);
+
+	sample_timer_update(data);
+
+	mutex_unlock(&data->timer_lock);
+
+	return count;
+}
+
+static ssize_t rate_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	struct RateStatistics rate;
+	u64 rate_millihertz = 0;
+	u64 jitter_mean = 0;
+
+	spin_lock_irq(&adc_lock);
+	rate = data->rate;
+	spin_unlock_irq(&adc_lock);
+
+	if (rate.samples > 1 && rate.last - rate.first >= NSEC_PER_USEC)
+	{
+		rate_millihertz = div64_u64((rate.samples - 1) * NSEC_PER_SEC, div_u64(rate.last - rate.first, NSEC_PER_USEC));
+		jitter_mean = div64_u64(rate.jitter_total, rate.samples - 1);
+	}
+
+	return sprintf(buffer, "samples %llu missed %llu rate_millihertz %llu interval_min_ns %lld interval_max_ns %lld jitter_mean_ns %llu jitter_max_ns %lld\n",
+		(unsigned long long)rate.samples,
+		(unsigned long long)rate.missed,
+		(unsigned long long)rate_millihertz,
+		(long long)rate.interval_min,
+		(long long)rate.interval_max,
+		(unsigned long long)jitter_mean,
+		(long long)rate.jitter_max);
+}
+
+// Quotient with 20 fractional bits, exact as long as the divisor stays below 2^44
+static u64 fixed_divide (u64 dividend, u64 divisor)
+{
+	u64 quotient = div64_u64(dividend, divisor);
+
+	return (quotient << 20) + div64_u64((dividend - quotient * divisor) << 20, divisor);
+}
+
+/*
+ * Statistics of the raw values of all conversions on the channel, mean and variance
+ * in thousandths. Writing anything to the attribute starts over.
+ */
+static ssize_t statistics_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	struct ValueStatistics statistics;
+	u64 mean = 0;
+	u64 variance = 0;
+
+	spin_lock_irq(&adc_lock);
+	statistics = data->statistics;
+	spin_unlock_irq(&adc_lock);
+
+	if (statistics.count > 0)
+	{
+		// both in units of 2^-20, E[x^2] - E[x]^2 cannot cancel badly since the sums are exact
+		mean = fixed_divide(statistics.sum, statistics.count);
+		variance = fixed_divide(statistics.sum_squares, statistics.count) - ((mean * mean) >> 20);
+	}
+
+	return sprintf(buffer, "count %llu min %u max %u mean_milli %llu variance_milli %llu\n",
+		(unsigned long long)statistics.count,
+		statistics.min,
+		statistics.max,
+		(unsigned long long)((mean * 1000) >> 20),
+		(unsigned long long)((variance * 1000) >> 20));
+}
+
+static ssize_t statistics_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+
+	spin_lock_irq(&adc_lock);
+	memset(&data->statistics, 0, sizeof(struct ValueStatistics));
+	spin_unlock_irq(&adc_lock);
+
+	return count;
+}
+
+// Fills the table by linear interpolation between the points, the outer segments are extended to the ends
+static void calibration_build (int* table, const struct CalibrationPoint* points, int count)
+{
+	const struct CalibrationPoint* low = &points[0];
+	const struct CalibrationPoint* high = &points[1];
+	int code;
+
+	for (code = 0; code < ADC_CODES; ++code)
+	{
+		while (code > high->code && high < &points[count - 1])
+		{
+			low = high++;
+		}
+
+		table[code] = low->millivolts + (high->millivolts - low->millivolts) * (code - low->code) / (high->code - low->code);
+	}
+}
+
+static ssize_t calibration_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	ssize_t length = 0;
+	int i;
+
+	spin_lock_irq(&adc_lock);
+
+	for (i = 0; i < data->calibration_count; ++i)
+	{
+		length += sprintf(buffer + length, "%s%d %d", i == 0 ? "" : " ", data->calibration_points[i].code, data->calibration_points[i].millivolts);
+	}
+
+	spin_unlock_irq(&adc_lock);
+
+	length += sprintf(buffer + length, "\n");
+	return length;
+}
+
+/*
+ * Takes 2 to 32 "code millivolts" pairs with increasing codes and millivolts within
+ * +-100000, the table holds the piecewise linear curve through them. The default is 0 0 1023 3300.
+ */
+static ssize_t calibration_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	struct CalibrationPoint points[ADC_CALIBRATION_POINTS];
+	int* table;
+	int found = 0;
+	int offset = 0;
+	int used;
+
+	while (found < ADC_CALIBRATION_POINTS && sscanf(buffer + offset, "%d %d%n", &points[found].code, &points[found].millivolts, &used) == 2)
+	{
+		if (points[found].code < 0 || points[found].code >= ADC_CODES || (found > 0 && points[found].code <= points[found - 1].code) ||
+			points[found].millivolts < -ADC_CALIBRATION_MAX_MV || points[found].millivolts > ADC_CALIBRATION_MAX_MV)
+		{
+			return -EINVAL;
+		}
+
+		offset += used;
+		found++;
+	}
+
+	if (found < 2 || skip_spaces(buffer + offset)[0] != '\0')
+	{
+		return -EINVAL;
+	}
+
+	table = kmalloc(sizeof(int) * ADC_CODES, GFP_KERNEL);
+	if (table == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	calibration_build(table, points, found);
+
+	spin_lock_irq(&adc_lock);
+	memcpy(data->calibration, table, sizeof(int) * ADC_CODES);
+	memcpy(data->calibration_points, points, sizeof(struct CalibrationPoint) * found);
+	data->calibration_count = found;
+	spin_unlock_irq(&adc_lock);
+
+	kfree(table);
+	return count;
+}
+
+static ssize_t capture_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+
+	return sprintf(buffer, "%u %u\n", data->capture.pre, data->capture.post);
+}
+
+// Takes "pre post" with at least one post-trigger sample, used from the next trigger on
+static ssize_t capture_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	unsigned int pre;
+	unsigned int post;
+
+	if (sscanf(buffer, "%u %u", &pre, &post) != 2 || post == 0 || pre > ADC_CAPTURE_SAMPLES || post > ADC_CAPTURE_SAMPLES - pre)
+	{
+		return -EINVAL;
+	}
+
+	spin_lock_irq(&adc_lock);
+	data->capture.pre = pre;
+	data->capture.post = post;
+	spin_unlock_irq(&adc_lock);
+
+	return count;
+}
+
+static ssize_t oversampling_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+
+	return sprintf(buffer, "%u\n", data->oversampling);
+}
+
+/*
+ * Single conversions of the channel add up 4^n conversions and shift the sum right by n
+ * to get n extra bits, so a factor of 16 returns 12 bit values. Odd powers of two return
+ * the resolution of the next lower even one with a little less noise. Streams, scans,
+ * batches and triggers keep returning raw values.
+ */
+static ssize_t oversampling_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	unsigned long factor;
+
+	if (strict_strtoul(buffer, 10, &factor) != 0 || factor == 0 || factor > ADC_MAX_OVERSAMPLING || !is_power_of_2(factor))
+	{
+		return -EINVAL;
+	}
+
+	spin_lock_irq(&adc_lock);
+	data->oversampling = factor;
+	spin_unlock_irq(&adc_lock);
+
+	return count;
+}
+
+static ssize_t max_age_ns_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+
+	return sprintf(buffer, "%llu\n", (unsigned long long)data->max_age_ns);
+}
+
+// Oldest value a reader in cached mode accepts before a new conversion is done
+static ssize_t max_age_ns_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	unsigned long long age;
+
+	if (strict_strtoull(buffer, 10, &age) != 0 || age > KTIME_MAX)
+	{
+		return -EINVAL;
+	}
+
+	write_seqlock_irq(&data->cache_lock);
+	data->max_age_ns = age;
+	write_sequnlock_irq(&data->cache_lock);
+
+	return count;
+}
+
+static ssize_t window_show (struct device * dev, struct device_attribute * attr, char * buffer)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	struct WindowComparator window;
+
+	spin_lock_irq(&adc_lock);
+	window = data->window;
+	spin_unlock_irq(&adc_lock);
+
+	if (!window.enabled)
+	{
+		return sprintf(buffer, "off\n");
+	}
+
+	return sprintf(buffer, "%d %d %d\n", window.low, window.high, window.hysteresis);
+}
+
+// Takes "low high hysteresis" or "off", a new window starts out inside and drops queued events
+static ssize_t window_store (struct device * dev, struct device_attribute * attr, const char * buffer, size_t count)
+{
+	struct ChannelData* data = dev_get_drvdata(dev);
+	bool enabled = true;
+	int low = 0;
+	int high = 0;
+	int hysteresis = 0;
+
+	if (sysfs_streq(buffer, "off"))
+	{
+		enabled = false;
+	}
+	else if (sscanf(buffer, "%d %d %d", &low, &high, &hysteresis) != 3 || low > high || hysteresis < 0)
+	{
+		return -EINVAL;
+	}
+
+	spin_lock_irq(&adc_lock);
+	data->window.enabled = enabled;
+	data->window.low = low;
+	data->window.high = high;
+	data->window.hysteresis = hysteresis;
+	data->window.state = ADC_WINDOW_INSIDE;
+	data->window.first = 0;
+	data->window.count = 0;
+	spin_unlock_irq(&adc_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR(period_ns, S_IWUSR | S_IRUGO, period_ns_show, period_ns_store);
+static DEVICE_ATTR(rate, S_IRUGO, rate_show, NULL);
+static DEVICE_ATTR(oversampling, S_IWUSR | S_IRUGO, oversampling_show, oversampling_store);
+static DEVICE_ATTR(max_age_ns, S_IWUSR | S_IRUGO, max_age_ns_show, max_age_ns_store);
+static DEVICE_ATTR(window, S_IWUSR | S_IRUGO, window_show, window_store);
+static DEVICE_ATTR(statistics, S_IWUSR | S_IRUGO, statistics_show, statistics_store);
+static DEVICE_ATTR(calibration, S_IWUSR | S_IRUGO, calibration_show, calibration_store);
+static DEVICE_ATTR(capture, S_IWUSR | S_IRUGO, capture_show, capture_store);
+
+static struct device_attribute* channel_attributes[] =
+{
+	&dev_attr_period_ns,
+	&dev_attr_rate,
+	&dev_attr_oversampling,
+	&dev_attr_max_age_ns,
+	&dev_attr_window,
+	&dev_attr_statistics,
+	&dev_attr_calibration,
+	&dev_attr_capture,
+	NULL
+};
+
+static void destroy_channel_devices (void)
+{
+	int i;
+	int j;
+
+	for(i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		if (channels[i].device == NULL)
+		{
+			continue;
+		}
+
+		for (j = 0; channel_attributes[j] != NULL; ++j)
+		{
+			device_remove_file(channels[i].device, channel_attributes[j]);
+		}
+
+		device_destroy(adc_class, MKDEV(MAJOR(deviceP), i));
+		channels[i].device = NULL;
+	}
+
+	class_destroy(adc_class);
+}
+
+// Creates /sys/class/ES6_ADC/adcN with the per channel attributes, udev/mdev also creates /dev/adcN from it
+static int create_channel_devices (void)
+{
+	int i;
+	int j;
+	int error;
+
+	adc_class = class_create(THIS_MODULE, DEVICE_NAME);
+	if (IS_ERR(adc_class))
+	{
+		return PTR_ERR(adc_class);
+	}
+
+	for(i = 0; i < ADC_NUMCHANNELS; ++i)
+	{
+		channels[i].device = device_create(adc_class, NULL, MKDEV(MAJOR(deviceP), i), &channels[i], "adc%d", i);
+		if (IS_ERR(channels[i].device))
+		{
+			error = PTR_ERR(channels[i].device);
+			channels[i].device = NULL;
+			destroy_channel_devices();
+			return error;
+		}
+
+		for (j = 0; channel_attributes[j] != NULL; ++j)
+		{
+			error = device_create_file(channels[i].device, channel_attributes[j]);
+			if (error != 0)
+			{
+				destroy_channel_devices();
+				return error;
+			}
+		}
+	}
+
+	return SUCCESS;
+}
+
+/*
+ * Prints a histogram snapshot, p99 is the upper bound of the bucket that holds
+ * the 99th percentile, limited to the largest latency seen.
+ */
+static int latency_show (struct seq_file * file, struct LatencyHistogram* source)
+{
+	struct LatencyHistogram histogram;
+	u64 wanted;
+	u64 seen = 0;
+	u64 p99 = 0;
+	int i;
+
+	spin_lock_irq(&adc_lock);
+	histogram = *source;
+	spin_unlock_irq(&adc_lock);
+
+	seq_printf(file, "count %llu\n", (unsigned long long)histogram.count);
+
+	if (histogram.count == 0)
+	{
+		return SUCCESS;
+	}
+
+	wanted = div_u64(histogram.count * 99 + 99, 100);
+	for (i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		seen += histogram.buckets[i];
+		if (seen >= wanted)
+		{
+			p99 = min_t(u64, 1ULL << i, histogram.max);
+			break;
+		}
+	}
+
+	seq_printf(file, "min_ns %llu\nmax_ns %llu\nmean_ns %llu\np99_ns %llu\n",
+		(unsigned long long)histogram.min,
+		(unsigned long long)histogram.max,
+		(unsigned long long)div64_u64(histogram.total, histogram.count),
+		(unsigned long long)p99);
+
+	for (i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		if (histogram.buckets[i] != 0)
+		{
+			seq_printf(file, "< %llu ns: %u\n", 1ULL << i, histogram.buckets[i]);
+		}
+	}
+
+	return SUCCESS;
+}
+
+static int latency_file_show (struct seq_file * file, void * unused)
+{
+	return latency_show(file, file->private);
+}
+
+// Every histogram file carries its histogram in i_private
+static int latency_open (struct inode * inode, struct file * file)
+{
+	return single_open(file, latency_file_show, inode->i_private);
+}
+
+// Writing anything to the file starts a new histogram
+static ssize_t latency_write (struct file * file, const char __user * buffer, size_t len, loff_t * offset)
+{
+	struct LatencyHistogram* histogram = ((struct seq_file*)file->private_data)->private;
+
+	spin_lock_irq(&adc_lock);
+	memset(histogram, 0, sizeof(struct LatencyHistogram));
+	spin_unlock_irq(&adc_lock);
+
+	return len;
+}
+
+static struct file_operations latency_fops =
+{
+	.owner = THIS_MODULE,
+	.open = latency_open,
+	.read = seq_read,
+	.write = latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Clock characterisation, reading the file runs CHARACTERISE_CONVERSIONS back to back conversions
+ * of one channel at each divider and restores the divider afterwards. Keep the input still and
+ * the converter otherwise idle, other users stretch the rate and share the conversion times.
+ * Writing a channel number to the file selects the channel.
+ */
+static const unsigned int characterise_dividers[] = { 0, 256, 128, 64, 32, 16, 8, 6, 4, 3 };
+static unsigned int characterise_channel = 0;
+
+static u32 sqrt64 (u64 value)
+{
+	u64 root = 0;
+	u64 bit = 1ULL << 62;
+
+	while (bit > value)
+	{
+		bit >>= 2;
+	}
+
+	while (bit != 0)
+	{
+		if (value >= root + bit)
+		{
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+static int characterise_divider (struct seq_file * file, unsigned int divider)
+{
+	u8 channel = characterise_channel;
+	u64 conversions;
+	u64 total;
+	u64 sum = 0;
+	u64 sum_squares = 0;
+	u64 mean;
+	u64 variance;
+	u16 low = ADC_VALUE_MASK;
+	u16 high = 0;
+	s64 start;
+	long error;
+	int i;
+
+	clock_divider_update(divider);
+
+	spin_lock_irq(&adc_lock);
+	conversions = conversion_time.count;
+	total = conversion_time.total;
+	spin_unlock_irq(&adc_lock);
+
+	start = ktime_to_ns(ktime_get());
+	error = batch_execute(&channel, 1, CHARACTERISE_CONVERSIONS);
+	if (error != SUCCESS)
+	{
+		return error;
+	}
+
+	spin_lock_irq(&adc_lock);
+	conversions = conversion_time.count - conversions;
+	total = conversion_time.total - total;
+	spin_unlock_irq(&adc_lock);
+
+	for (i = 0; i < CHARACTERISE_CONVERSIONS; ++i)
+	{
+		sum += batch_values[i];
+		sum_squares += (u32)batch_values[i] * batch_values[i];
+		low = min(low, batch_values[i]);
+		high = max(high, batch_values[i]);
+	}
+
+	mean = fixed_divide(sum, CHARACTERISE_CONVERSIONS);
+	variance = fixed_divide(sum_squares, CHARACTERISE_CONVERSIONS) - ((mean * mean) >> 20);
+
+	seq_printf(file, "%-8u %-16llu %-10llu %-10llu %-12u %u\n",
+		divider,
+		(unsigned long long)(conversions != 0 ? div64_u64(total, conversions) : 0),
+		(unsigned long long)div64_u64((u64)CHARACTERISE_CONVERSIONS * NSEC_PER_SEC, max_t(s64, batch_timestamp - start, 1)),
+		(unsigned long long)((mean * 1000) >> 20),
+		sqrt64((variance * 1000000) >> 20),
+		high - low);
+
+	return SUCCESS;
+}
+
+static int characterise_show (struct seq_file * file, void * unused)
+{
+	unsigned int previous;
+	int error = SUCCESS;
+	int i;
+
+	if (mutex_lock_interruptible(&batch_lock) != 0)
+	{
+		return -ERESTARTSYS;
+	}
+
+	previous = clock_divider;
+
+	seq_printf(file, "channel %u, %u conversions per divider, 0 is the 32 kHz RTC clock\n", characterise_channel, CHARACTERISE_CONVERSIONS);
+	seq_printf(file, "divider  conversion_ns    rate_hz    mean_milli stddev_milli peak_to_peak\n");
+
+	for (i = 0; i < ARRAY_SIZE(characterise_dividers) && error == SUCCESS; ++i)
+	{
+		error = characterise_divider(file, characterise_dividers[i]);
+	}
+
+	clock_divider_update(previous);
+	mutex_unlock(&batch_lock);
+
+	return error;
+}
+
+static int characterise_open (struct inode * inode, struct file * file)
+{
+	return single_open(file, characterise_show, NULL);
+}
+
+static ssize_t characterise_write (struct file * file, const char __user * buffer, size_t len, loff_t * offset)
+{
+	char text[8];
+	unsigned long channel;
+
+	if (len >= sizeof(text))
+	{
+		return -EINVAL;
+	}
+
+	if (copy_from_user(text, buffer, len) != 0)
+	{
+		return -EFAULT;
+	}
+	text[len] = '\0';
+
+	if (strict_strtoul(text, 10, &channel) != 0 || channel >= ADC_NUMCHANNELS)
+	{
+		return -EINVAL;
+	}
+
+	characterise_channel = channel;
+	return len;
+}
+
+static struct file_operations characterise_fops =
+{
+	.owner = THIS_MODULE,
+	.open = characterise_open,
+	.read = seq_read,
+	.write = characterise_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// debugfs is a diagnostics aid only, the driver works fine without it
+static void create_debugfs (void)
+{
+	adc_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+	if (IS_ERR(adc_debugfs) || adc_debugfs == NULL)
+	{
+		adc_debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("trigger_latency", S_IRUGO | S_IWUSR, adc_debugfs, &trigger_latency, &latency_fops);
+	debugfs_create_file("irq_time", S_IRUGO | S_IWUSR, adc_debugfs, &irq_time, &latency_fops);
+	debugfs_create_u32("conversions_lost", S_IRUGO, adc_debugfs, &conversions_lost);
+	debugfs_create_file("conversion_time", S_IRUGO | S_IWUSR, adc_debugfs, &conversion_time, &latency_fops);
+	debugfs_create_u32("conversion_timeouts", S_IRUGO, adc_debugfs, &conversion_timeouts);
+	debugfs_create_file("resume_latency", S_IRUGO | S_IWUSR, adc_debugfs, &resume_latency, &latency_fops);
+	debugfs_create_u32("suspend_count", S_IRUGO, adc_debugfs, &suspend_count);
+	debugfs_create_file("clock_characterisation", S_IRUSR | S_IWUSR, adc_debugfs, NULL, &characterise_fops);
+}
+
+static void free_rings (void)
+{
+    int i;
+
+    for(i = 0; i < ADC_NUMCHANNELS; ++i)
+    {
+        if (channels[i].ring != NULL)
+        {
+            vfree(channels[i].ring);
+            channels[i].ring = NULL;
+        }
+    }
+}
+
+int init_adc_module (void)
+{
+    int i;
+	int error = alloc_chrdev_region(&deviceP, 0, ADC_NUMCHANNELS, DEVICE_NAME);
+
+	if(error < 0)
+	{
+		printk(KERN_DEBUG DEVICE_NAME ": dynamic allocation of major number failed, error=%d\n", error);
+		return error;
+	}
+
+	printk(KERN_DEBUG DEVICE_NAME ": major number=%d\n", MAJOR(deviceP));
+
+    for(i = 0; i < ADC_NUMCHANNELS; ++i)
+    {
+        channels[i].ring = vmalloc_user(ADC_RING_BYTES);
+        if (channels[i].ring == NULL)
+        {
+            free_rings();
+            unregister_chrdev_region(deviceP, ADC_NUMCHANNELS);
+            return -ENOMEM;
+        }
+
+        channels[i].header = channels[i].ring;
+        channels[i].header->size = ADC_RING_SIZE;
+        channels[i].samples = (struct AdcSample*)((char*)channels[i].ring + ADC_RING_HEADER_SIZE);
+        channels[i].head = 0;
+
+        mutex_init(&channels[i].read_lock);
+        init_waitqueue_head(&channels[i].wait);
+
+        channels[i].number = i;
+        channels[i].oversampling = 1;
+        seqlock_init(&channels[i].cache_lock);
+        channels[i].max_age_ns = ADC_DEFAULT_MAX_AGE_NS;
+        init_waitqueue_head(&channels[i].window.wait);
+
+        channels[i].capture.pre = 64;
+        channels[i].capture.post = 64;
+        init_waitqueue_head(&channels[i].capture.wait);
+
+        channels[i].calibration_points[0].code = 0;
+        channels[i].calibration_points[0].millivolts = 0;
+        channels[i].calibration_points[1].code = ADC_CODES - 1;
+        channels[i].calibration_points[1].millivolts = ADC_REFERENCE_MV;
+        channels[i].calibration_count = 2;
+        calibration_build(channels[i].calibration, channels[i].calibration_points, 2);
+        mutex_init(&channels[i].timer_lock);
+        hrtimer_init(&channels[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        channels[i].timer.function = sample_timer;
+    }
+
+	cdev_init(&cDevices, &fops);
+	cDevices.owner = THIS_MODULE;
+	cDevices.ops = &fops;
+
+	error = cdev_add(&cDevices, deviceP, ADC_NUMCHANNELS);
+	if(error < 0)
+	{
+		printk(KERN_WARNING DEVICE_NAME ": unable to add device, error=%d\n", error);
+		free_rings();
+		unregister_chrdev_region(deviceP, ADC_NUMCHANNELS);
+		return error;
+	}
+
+	error = create_channel_devices();
+	if(error != SUCCESS)
+	{
+		printk(KERN_WARNING DEVICE_NAME ": unable to create the sysfs devices, error=%d\n", error);
+		cdev_del(&cDevices);
+		free_rings();
+		unregister_chrdev_region(deviceP, ADC_NUMCHANNELS);
 		return error;
 	}
 
@@ -280,17 +3221,20 @@ int init_adc_module (void)
         printk(KERN_INFO DEVICE_NAME ": mknod /dev/adc%d c %d %d\n", i, MAJOR(deviceP), i);
     }
   
+	create_debugfs();
 	adc_init();
-	sema_init(&channel_conversion, 1);
 	return SUCCESS;
 }
 
 void cleanup_adc_module()
 {
+	debugfs_remove_recursive(adc_debugfs);
+	destroy_channel_devices();
 	cdev_del(&cDevices);
 	unregister_chrdev_region(deviceP, ADC_NUMCHANNELS);
 
 	adc_exit();
+	free_rings();
 }
 
 module_init(init_adc_module);
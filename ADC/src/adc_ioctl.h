@@ -0,0 +1,145 @@
+#ifndef ADC_IOCTL_H_INCLUDED
+#define ADC_IOCTL_H_INCLUDED
+
+/*
+ * Interface shared between the ES6_ADC kernel module and userspace.
+ * Only depends on linux/types.h and linux/ioctl.h so applications can include it as well.
+ * A read() or ADC_IOC_BATCH whose conversion got no interrupt within the conversion_timeout_ms
+ * module parameter fails with ETIMEDOUT, the next one converts again.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ADC_IOC_MAGIC ('a')
+#define ADC_NUMCHANNELS (3)
+
+enum AdcReadMode
+{
+	ADC_MODE_ASCII,   // one conversion per open/seek, value returned as decimal text (default)
+	ADC_MODE_STREAM,  // channel is sampled continuously, read() returns struct AdcSample records
+	ADC_MODE_SCAN,    // every read() converts all channels back to back and returns one struct AdcScan
+	ADC_MODE_TRIGGER, // read() returns a struct AdcTriggerEvent for every EINT0 trigger, shared by all channel devices
+	ADC_MODE_REPEAT,  // every read() converts again and returns the value as decimal text and a newline, the file position is ignored
+	ADC_MODE_CACHED,  // like ADC_MODE_REPEAT, but the last value is returned without converting if it is younger than max_age_ns in sysfs
+	ADC_MODE_WINDOW,  // the channel is sampled continuously, read() returns a struct AdcWindowEvent whenever it crosses the window in sysfs
+	ADC_MODE_MILLIVOLT, // like ADC_MODE_REPEAT, but the value is calibrated to millivolts with the calibration in sysfs
+	ADC_MODE_CAPTURE, // the channel is sampled continuously, read() returns a struct AdcCapture around every EINT0 trigger
+	ADC_MODE_MAX
+};
+
+struct AdcSample
+{
+	__u64 timestamp;  // CLOCK_MONOTONIC in nanoseconds, taken in the conversion interrupt
+	__u32 sequence;   // per channel, gaps mean samples were dropped because nobody read them
+	__u16 channel;
+	__u16 value;
+};
+
+struct AdcScan
+{
+	__u64 timestamp;  // CLOCK_MONOTONIC in nanoseconds, taken when the last channel completed
+	__u16 values[ADC_NUMCHANNELS];
+	__u16 reserved;
+};
+
+struct AdcTriggerEvent
+{
+	__u64 trigger_timestamp;  // CLOCK_MONOTONIC in nanoseconds, taken in the EINT0 interrupt
+	__u64 complete_timestamp; // taken when the last channel of the trigger was converted
+	__u32 sequence;           // gaps mean events were dropped because nobody read them
+	__u16 channels;           // bit mask of the converted channels, the other values are 0
+	__u16 values[ADC_NUMCHANNELS];
+	__u32 reserved;
+};
+
+struct AdcTriggerStats
+{
+	__u32 received;  // EINT0 interrupts seen
+	__u32 serviced;  // triggers that were converted
+	__u32 dropped;   // triggers discarded because trigger_depth triggers were already waiting
+	__u32 lost;      // converted triggers discarded because the event queue of the readers was full
+	__u32 pending;   // triggers waiting for the converter right now
+	__u32 timed_out; // triggers abandoned because one of their conversions timed out
+};
+
+/*
+ * The window of a channel is set by writing "low high hysteresis" to its window attribute
+ * in sysfs, or "off". The value is below the window once it drops under low and only back
+ * inside once it reaches low + hysteresis again, the upper edge works the same way.
+ */
+enum AdcWindowState
+{
+	ADC_WINDOW_INSIDE,
+	ADC_WINDOW_BELOW,
+	ADC_WINDOW_ABOVE
+};
+
+struct AdcWindowEvent
+{
+	__u64 timestamp;  // CLOCK_MONOTONIC in nanoseconds of the conversion that crossed
+	__u32 sequence;   // per channel, gaps mean events were dropped because nobody read them
+	__u16 value;
+	__u8  channel;
+	__u8  state;      // enum AdcWindowState entered with this conversion
+};
+
+/*
+ * In capture mode the samples of the channel around an EINT0 trigger are frozen into one
+ * struct AdcCapture, set "pre post" in the capture attribute in sysfs (default 64 64).
+ * Triggers that arrive while a capture is collected or waiting to be read are skipped.
+ */
+#define ADC_CAPTURE_SAMPLES (256)  // pre + post at most
+
+struct AdcCapture
+{
+	__u64 trigger_timestamp;  // CLOCK_MONOTONIC in nanoseconds, taken in the EINT0 interrupt
+	__u32 sequence;           // EINT0 triggers seen in capture mode, gaps mean triggers were skipped
+	__u16 pre;                // samples before the trigger, fewer than asked for if the channel just started
+	__u16 post;               // samples at or after the trigger
+	struct AdcSample samples[ADC_CAPTURE_SAMPLES];  // pre + post samples in time order
+};
+
+/*
+ * ADC_IOC_BATCH converts the channel list repeat times back to back and blocks until all
+ * count * repeat results are stored at values, round by round in channel list order.
+ * The converter is held for the whole batch, so keep batches short next to streams or triggers.
+ */
+#define ADC_BATCH_CHANNELS (16)
+#define ADC_BATCH_MAX (1024)  // conversions per batch
+
+struct AdcBatch
+{
+	__u64 values;     // user address of the __u16 results
+	__u64 timestamp;  // returned, CLOCK_MONOTONIC in nanoseconds when the last conversion completed
+	__u32 repeat;
+	__u32 count;      // entries used in channels
+	__u8  channels[ADC_BATCH_CHANNELS];
+};
+
+/*
+ * Every channel has a sample ring that can be mapped with mmap(fd, ADC_RING_BYTES, ...).
+ * The struct AdcRingHeader sits at offset 0 and the slots start at ADC_RING_HEADER_SIZE.
+ * The driver fills slots[head % ADC_RING_SIZE] and then advances head, the consumer reads
+ * slots from tail up to head and then advances tail. Both counters wrap naturally.
+ * The channel is sampled continuously for as long as it is mapped, put the descriptor
+ * in ADC_MODE_STREAM as well to poll() for new slots instead of spinning on head.
+ */
+#define ADC_RING_SIZE (1024)  // slots per channel, power of two
+#define ADC_RING_HEADER_SIZE (4096)
+#define ADC_RING_BYTES (ADC_RING_HEADER_SIZE + ADC_RING_SIZE * sizeof(struct AdcSample))
+
+struct AdcRingHeader
+{
+	__u32 head;      // written by the driver only
+	__u32 tail;      // written by the consumer only
+	__u32 size;
+	__u32 overruns;  // samples dropped because the ring was full
+};
+
+#define ADC_IOC_SET_MODE _IOW(ADC_IOC_MAGIC, 0, int)
+#define ADC_IOC_GET_MODE _IOR(ADC_IOC_MAGIC, 1, int)
+#define ADC_IOC_GET_TRIGGER_STATS _IOR(ADC_IOC_MAGIC, 2, struct AdcTriggerStats)
+#define ADC_IOC_BATCH _IOWR(ADC_IOC_MAGIC, 3, struct AdcBatch)
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Trace events of the ES6_ADC module. Without CONFIG_TRACEPOINTS they compile to nothing,
+ * otherwise they are switched on at runtime through
+ * /sys/kernel/debug/tracing/events/es6_adc/ and recorded in the ftrace ring buffer.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM es6_adc
+
+#if !defined(ADC_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define ADC_TRACE_H_INCLUDED
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(adc_start,
+
+	TP_PROTO(int channel),
+
+	TP_ARGS(channel),
+
+	TP_STRUCT__entry(
+		__field(int, channel)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+	),
+
+	TP_printk("channel=%d", __entry->channel)
+);
+
+TRACE_EVENT(adc_timeout,
+
+	TP_PROTO(int channel),
+
+	TP_ARGS(channel),
+
+	TP_STRUCT__entry(
+		__field(int, channel)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+	),
+
+	TP_printk("channel=%d", __entry->channel)
+);
+
+TRACE_EVENT(adc_conversion,
+
+	TP_PROTO(int channel, int value, s64 timestamp),
+
+	TP_ARGS(channel, value, timestamp),
+
+	TP_STRUCT__entry(
+		__field(int, channel)
+		__field(int, value)
+		__field(s64, timestamp)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->value = value;
+		__entry->timestamp = timestamp;
+	),
+
+	TP_printk("channel=%d value=%d timestamp=%lld", __entry->channel, __entry->value, (long long)__entry->timestamp)
+);
+
+TRACE_EVENT(adc_trigger,
+
+	TP_PROTO(s64 timestamp, unsigned int pending, int dropped),
+
+	TP_ARGS(timestamp, pending, dropped),
+
+	TP_STRUCT__entry(
+		__field(s64, timestamp)
+		__field(unsigned int, pending)
+		__field(bool, dropped)
+	),
+
+	TP_fast_assign(
+		__entry->timestamp = timestamp;
+		__entry->pending = pending;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("timestamp=%lld pending=%u dropped=%d", (long long)__entry->timestamp, __entry->pending, __entry->dropped)
+);
+
+#endif
+
+// the module is built out of tree, so tell define_trace.h where to find this header again
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE adc_trace
+#include <trace/define_trace.h>